@@ -0,0 +1,78 @@
+/**
+ * Microbenchmark of command dispatch: the perfect hash of cmd-hash.h
+ * against the linear, case-insensitive scan of the dispatch table it
+ * replaced. Run with `make bench`.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define CMD_HASH_NAMES
+#include "cmd-hash.h"
+
+#define NELMS(array) (sizeof(array) / sizeof(array[0]))
+#define ROUNDS 2000000
+
+/* A mix of commands as clients send them, and words that are not commands */
+static const char* corpus[] = {
+    "PRIVMSG", "privmsg", "PRIVMSG", "PRIVMSG", "Privmsg", "PRIVMSG",
+    "JOIN", "join", "PART", "NICK", "nick", "USER", "QUIT", "WHO",
+    "LIST", "who", "PING", "PONG", "MODE", "NOTICE", "TOPIC", "PRIVMSGS",
+};
+
+
+static int linear_index(const char* word, size_t len)
+{
+    for (int i = 0; i < NELMS(cmd_hash_names); i++)
+        if (!strncasecmp(cmd_hash_names[i], word, len) && cmd_hash_names[i][len] == '\0')
+            return i;
+    return -1;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double run(const char* name, int (*lookup)(const char*, size_t))
+{
+    // Words are copied out, so that nothing can be hoisted out of the loop
+    char words[NELMS(corpus)][16];
+    size_t lens[NELMS(corpus)];
+    for (int i = 0; i < NELMS(corpus); i++)
+        lens[i] = strlen(strcpy(words[i], corpus[i]));
+
+    volatile int sink = 0;
+    double start = now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < NELMS(corpus); i++)
+            sink += lookup(words[i], lens[i]);
+    double elapsed = now() - start;
+    double rate = ROUNDS * NELMS(corpus) / elapsed;
+    printf("%-8s %8.1f M lines/s (%.2f ns/line)\n", name, rate / 1e6, 1e9 / rate);
+    return rate;
+}
+
+
+int main(void)
+{
+    // Both lookups must agree before we time them
+    for (int i = 0; i < NELMS(corpus); i++)
+    {
+        size_t len = strlen(corpus[i]);
+        if (command_index(corpus[i], len) != linear_index(corpus[i], len))
+        {
+            fprintf(stderr, "Mismatch on %s\n", corpus[i]);
+            return 1;
+        }
+    }
+    double linear = run("linear", linear_index);
+    double hashed = run("hash", command_index);
+    printf("speedup  %8.1fx\n", hashed / linear);
+    return 0;
+}
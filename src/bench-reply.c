@@ -0,0 +1,186 @@
+/**
+ * Microbenchmark of reply formatting: the |ReplyBuilder| of reply.h, with
+ * the server prefix and client source rendered beforehand, against
+ * vsnprintf() of the whole line, as |reply()| does. Run with `make bench`.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "reply.h"
+
+#define ROUNDS 2000000
+
+static const char* hostname = "irc.example.org";
+static const char* nick = "rui";
+static const char* user = "junrui";
+static const char* host = "client-42.example.net";
+static const char* channel = "#cmpu375";
+static const char* text = "has anyone finished the second checkpoint yet? the tester hangs on WHO";
+
+static char prefix[80];     // ":hostname "
+static size_t prefix_len;
+static char source[128];    // ":nick!user@host"
+static size_t source_len;
+
+
+static size_t format(char* line, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, RB_MAX_LEN + 1, format, args);
+    va_end(args);
+    return len;
+}
+
+
+/* The lines, as formatted by printf() */
+
+static size_t printf_privmsg(char* line)
+{
+    return format(line, ":%s PRIVMSG %s :%s\r\n", nick, channel, text);
+}
+
+static size_t printf_join(char* line)
+{
+    return format(line, ":%s!%s@%s JOIN %s\r\n", nick, user, host, channel);
+}
+
+static size_t printf_names(char* line)
+{
+    return format(line, ":%s %d %s = %s :%s\r\n", hostname, 353, nick, channel, nick);
+}
+
+static size_t printf_who(char* line)
+{
+    return format(line, ":%s %d %s %s %s %s %s %s H :0 %s\r\n", hostname, 352, nick,
+                  channel, user, host, hostname, nick, "Junrui Liu");
+}
+
+
+/* The same lines, built */
+
+static size_t build_privmsg(char* line)
+{
+    ReplyBuilder rb;
+    rb_reset(&rb);
+    RB_LITERAL(&rb, ":");
+    rb_str(&rb, nick);
+    RB_LITERAL(&rb, " PRIVMSG ");
+    rb_str(&rb, channel);
+    RB_LITERAL(&rb, " :");
+    rb_str(&rb, text);
+    size_t len = rb_finish(&rb);
+    memcpy(line, rb.data, len + 1);
+    return len;
+}
+
+static size_t build_join(char* line)
+{
+    ReplyBuilder rb;
+    rb_reset(&rb);
+    rb_append(&rb, source, source_len);
+    RB_LITERAL(&rb, " JOIN ");
+    rb_str(&rb, channel);
+    size_t len = rb_finish(&rb);
+    memcpy(line, rb.data, len + 1);
+    return len;
+}
+
+static size_t build_names(char* line)
+{
+    ReplyBuilder rb;
+    rb_reset(&rb);
+    rb_append(&rb, prefix, prefix_len);
+    rb_numeric(&rb, 353);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, nick);
+    RB_LITERAL(&rb, " = ");
+    rb_str(&rb, channel);
+    RB_LITERAL(&rb, " :");
+    rb_str(&rb, nick);
+    size_t len = rb_finish(&rb);
+    memcpy(line, rb.data, len + 1);
+    return len;
+}
+
+static size_t build_who(char* line)
+{
+    ReplyBuilder rb;
+    rb_reset(&rb);
+    rb_append(&rb, prefix, prefix_len);
+    rb_numeric(&rb, 352);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, nick);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, channel);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, user);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, host);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, hostname);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, nick);
+    RB_LITERAL(&rb, " H :0 ");
+    rb_str(&rb, "Junrui Liu");
+    size_t len = rb_finish(&rb);
+    memcpy(line, rb.data, len + 1);
+    return len;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double run(size_t (*make_line)(char*))
+{
+    char line[RB_MAX_LEN + 1];
+    volatile size_t sink = 0;
+    double start = now();
+    for (int r = 0; r < ROUNDS; r++)
+        sink += make_line(line);
+    return ROUNDS / (now() - start);
+}
+
+
+int main(void)
+{
+    static const struct {
+        const char* name;
+        size_t (*printf_line)(char*);
+        size_t (*build_line)(char*);
+    } cases[] = {
+        { "PRIVMSG", printf_privmsg, build_privmsg },
+        { "JOIN",    printf_join,    build_join },
+        { "NAMES",   printf_names,   build_names },
+        { "WHO",     printf_who,     build_who },
+    };
+
+    prefix_len = snprintf(prefix, sizeof(prefix), ":%s ", hostname);
+    source_len = snprintf(source, sizeof(source), ":%s!%s@%s", nick, user, host);
+
+    printf("%-8s %16s %16s %8s\n", "line", "printf M/s", "builder M/s", "speedup");
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        // Both paths must produce the same line before we time them
+        char expected[RB_MAX_LEN + 1], built[RB_MAX_LEN + 1];
+        cases[i].printf_line(expected);
+        cases[i].build_line(built);
+        if (strcmp(expected, built) != 0)
+        {
+            fprintf(stderr, "Mismatch on %s:\n%s%s", cases[i].name, expected, built);
+            return 1;
+        }
+        double slow = run(cases[i].printf_line);
+        double fast = run(cases[i].build_line);
+        printf("%-8s %16.1f %16.1f %7.1fx\n", cases[i].name, slow / 1e6, fast / 1e6, fast / slow);
+    }
+    return 0;
+}
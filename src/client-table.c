@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "client-table.h"
+#include "sircs.h"
+#include "debug.h"
+
+
+/**
+ * Initialize an empty table for up to |size| clients at a time.
+ */
+int init_client_table(ClientTable* table, int size)
+{
+    table->clients = calloc(size, sizeof(client_t*));
+    table->gens = calloc(size, sizeof(unsigned int));
+    table->free_slots = malloc(size * sizeof(unsigned int));
+    if (!table->clients || !table->gens || !table->free_slots)
+        return -1;
+    // Low slots first
+    for (int i = 0; i < size; i++)
+    {
+        table->free_slots[i] = size - 1 - i;
+        table->gens[i] = 1;
+    }
+    table->num_free = size;
+    table->size = size;
+    table->high_water = 0;
+    return 0;
+}
+
+
+/**
+ * Give the client a handle. Returns -1 if the table is full.
+ */
+int claim_handle(ClientTable* table, client_t* cli)
+{
+    if (table->num_free == 0)
+        return -1;
+    unsigned int slot = table->free_slots[--table->num_free];
+    table->clients[slot] = cli;
+    if (slot >= table->high_water)
+        table->high_water = slot + 1;
+    cli->handle.slot = slot;
+    cli->handle.gen = table->gens[slot];
+    return 0;
+}
+
+
+/**
+ * Invalidate the client's handle (if it has one), once it is freed.
+ */
+void release_handle(ClientTable* table, client_t* cli)
+{
+    if (cli->handle.gen == 0)
+        return;
+    unsigned int slot = cli->handle.slot;
+    table->clients[slot] = NULL;
+    if (++table->gens[slot] == 0)
+        table->gens[slot] = 1; // 0 is for null handles
+    table->free_slots[table->num_free++] = slot;
+    cli->handle.gen = 0;
+}
+
+
+/**
+ * Find the client a handle refers to, or NULL if it has been freed.
+ */
+client_t* find_client(ClientTable* table, client_handle_t handle)
+{
+    if (handle.slot >= table->size || table->gens[handle.slot] != handle.gen)
+        return NULL;
+    return table->clients[handle.slot];
+}
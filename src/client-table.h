@@ -0,0 +1,54 @@
+#ifndef _CLIENT_TABLE_H_
+#define _CLIENT_TABLE_H_
+
+/* Handle on a client (see |ClientTable|). A null handle has |gen| 0. */
+typedef struct {
+    unsigned int slot;
+    unsigned int gen;
+} client_handle_t;
+
+struct __client_struct;
+
+
+/**
+ * Client Table.
+ *
+ * Gives each client a handle, i.e. a slot in the table and the generation
+ * of the slot when the client got it, for the references to the client
+ * that may outlive it (lookups in progress, sends in flight, etc.).
+ * The generation of a slot is bumped when its client is freed, so that a
+ * stale handle simply resolves to nothing, and the slot can then be given
+ * to a new client.
+ *
+ * The table is only touched by the core loop.
+ *
+ * Example Usage
+
+     ClientTable table;
+     init_client_table(&table, MAX_CLIENTS);
+     claim_handle(&table, cli);          // Sets |cli->handle|
+     client_handle_t h = cli->handle;
+     // ...
+     client_t* cli = find_client(&table, h);   // NULL once freed
+     release_handle(&table, cli);
+
+*/
+typedef struct {
+    struct __client_struct** clients;
+    unsigned int* gens;
+    unsigned int* free_slots;   // Stack of free slots
+    int num_free;
+    int size;
+    unsigned int high_water;    // Slots from here on have never been used
+} ClientTable;
+
+
+int init_client_table(ClientTable* table, int size);
+
+int claim_handle(ClientTable* table, struct __client_struct* cli);
+
+void release_handle(ClientTable* table, struct __client_struct* cli);
+
+struct __client_struct* find_client(ClientTable* table, client_handle_t handle);
+
+#endif /* _CLIENT_TABLE_H_ */
@@ -0,0 +1,86 @@
+/* Generated by cmdhash.pl from the dispatch table in irc-proto.c. Do not edit. */
+#ifndef _CMD_HASH_H_
+#define _CMD_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_HASH_MULT 0x98a7afe3u
+#define CMD_HASH_BITS 5
+#define CMD_HASH_COUNT 9 // Commands in the table
+
+static const uint64_t cmd_hash_keys[32] = {
+    0x00000000004f4857ull, // WHO
+    0x0000000000000000ull,
+    0x0000000052455355ull, // USER
+    0x0000000000000000ull,
+    0x000000004b43494eull, // NICK
+    0x0000000054495551ull, // QUIT
+    0x0000000000000000ull,
+    0x00000053454d414eull, // NAMES
+    0x0047534d56495250ull, // PRIVMSG
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000054524150ull, // PART
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x000000004e494f4aull, // JOIN
+    0x0000000000000000ull,
+    0x000000005453494cull, // LIST
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+    0x0000000000000000ull,
+};
+
+static const signed char cmd_hash_index[32] = {
+    7, -1, 1, -1, 0, 2, -1, 8, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, -1, -1, 3, -1, 5, -1, -1, -1
+};
+
+#ifdef CMD_HASH_NAMES
+static const char* cmd_hash_names[] = {
+    "NICK",
+    "USER",
+    "QUIT",
+    "JOIN",
+    "PART",
+    "LIST",
+    "PRIVMSG",
+    "WHO",
+    "NAMES",
+};
+#endif
+
+/**
+ * Find the index of a command word of |len| bytes (without regard to case)
+ * in the dispatch table, or return -1 if it is not a command.
+ */
+static inline int command_index(const char* word, size_t len)
+{
+    if (len == 0 || len > 8)
+        return -1; // Longer than any command
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char) word[i];
+        if ((unsigned) (c - 'a') < 26)
+            c -= 'a' - 'A';
+        key |= (uint64_t) c << (8 * i);
+    }
+    uint32_t h = ((uint32_t) key * CMD_HASH_MULT + (uint32_t) (key >> 32)) * CMD_HASH_MULT;
+    unsigned slot = h >> (32 - CMD_HASH_BITS);
+    return cmd_hash_keys[slot] == key ? cmd_hash_index[slot] : -1;
+}
+
+#endif /* _CMD_HASH_H_ */
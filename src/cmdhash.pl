@@ -0,0 +1,111 @@
+#!/usr/bin/perl
+#
+# Generate a perfect hash of the command words of the dispatch table
+# (|cmds[]| in irc-proto.c, read from stdin): see cmd-hash.h.
+#
+# A command word of up to 8 characters, upper-cased, is packed into a
+# 64-bit key (first character in the low byte). The key is hashed as
+#   h = ((lo * MULT + hi) * MULT) mod 2^32, slot = h >> (32 - BITS)
+# where lo and hi are its low and high 32 bits, and we look for the
+# smallest table and a multiplier for which no two commands collide.
+
+use strict;
+use warnings;
+
+my $MASK = 0xffffffff;
+
+my @names;
+my $in_table = 0;
+while (<STDIN>) {
+    $in_table = 1 if /^struct dispatch cmds\[\]/;
+    next unless $in_table;
+    last if /^};/;
+    push @names, $1 if /^\s*\{\s*"([^"]+)"/;
+}
+die "cmdhash.pl: no dispatch table found\n" unless @names;
+
+my @keys;
+foreach my $name (@names) {
+    die "cmdhash.pl: command $name is longer than 8 characters\n" if length($name) > 8;
+    my $key = 0;
+    my $i = 0;
+    foreach my $c (split //, uc($name)) {
+        $key |= ord($c) << (8 * $i++);
+    }
+    push @keys, $key;
+}
+
+sub slot_of {
+    my ($key, $mult, $bits) = @_;
+    my $lo = $key & $MASK;
+    my $hi = ($key >> 32) & $MASK;
+    my $h = ((($lo * $mult) & $MASK) + $hi) & $MASK;
+    $h = ($h * $mult) & $MASK;
+    return $h >> (32 - $bits);
+}
+
+# Deterministic search, so that the output only changes with the table
+srand(375);
+my ($bits, $mult);
+SEARCH: for ($bits = 1; $bits <= 16; $bits++) {
+    next if (1 << $bits) < 2 * @keys;
+    for (my $try = 0; $try < 100000; $try++) {
+        my $m = (int(rand(1 << 16)) << 16 | int(rand(1 << 16))) | 1;
+        my %used;
+        my $ok = 1;
+        foreach my $key (@keys) {
+            my $slot = slot_of($key, $m, $bits);
+            if ($used{$slot}++) { $ok = 0; last; }
+        }
+        if ($ok) { $mult = $m; last SEARCH; }
+    }
+}
+die "cmdhash.pl: no perfect hash found\n" unless defined $mult;
+
+my $size = 1 << $bits;
+my @slot_keys = (0) x $size;
+my @slot_index = (-1) x $size;
+for (my $i = 0; $i < @keys; $i++) {
+    my $slot = slot_of($keys[$i], $mult, $bits);
+    $slot_keys[$slot] = $keys[$i];
+    $slot_index[$slot] = $i;
+}
+
+print "/* Generated by cmdhash.pl from the dispatch table in irc-proto.c. Do not edit. */\n";
+print "#ifndef _CMD_HASH_H_\n#define _CMD_HASH_H_\n\n#include <stddef.h>\n#include <stdint.h>\n\n";
+printf "#define CMD_HASH_MULT 0x%08xu\n", $mult;
+print "#define CMD_HASH_BITS $bits\n";
+print "#define CMD_HASH_COUNT ", scalar(@names), " // Commands in the table\n\n";
+print "static const uint64_t cmd_hash_keys[$size] = {\n";
+printf "    0x%016xull,%s\n", $slot_keys[$_],
+    $slot_index[$_] >= 0 ? " // $names[$slot_index[$_]]" : "" for 0 .. $size - 1;
+print "};\n\n";
+print "static const signed char cmd_hash_index[$size] = {\n    ";
+print join(", ", @slot_index), "\n};\n\n";
+print "#ifdef CMD_HASH_NAMES\nstatic const char* cmd_hash_names[] = {\n";
+print "    \"$_\",\n" foreach @names;
+print "};\n#endif\n\n";
+print <<'EOF';
+/**
+ * Find the index of a command word of |len| bytes (without regard to case)
+ * in the dispatch table, or return -1 if it is not a command.
+ */
+static inline int command_index(const char* word, size_t len)
+{
+    if (len == 0 || len > 8)
+        return -1; // Longer than any command
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char) word[i];
+        if ((unsigned) (c - 'a') < 26)
+            c -= 'a' - 'A';
+        key |= (uint64_t) c << (8 * i);
+    }
+    uint32_t h = ((uint32_t) key * CMD_HASH_MULT + (uint32_t) (key >> 32)) * CMD_HASH_MULT;
+    unsigned slot = h >> (32 - CMD_HASH_BITS);
+    return cmd_hash_keys[slot] == key ? cmd_hash_index[slot] : -1;
+}
+
+#endif /* _CMD_HASH_H_ */
+EOF
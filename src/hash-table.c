@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash-table.h"
+#include "debug.h"
+
+
+/**
+ * Hash a key (FNV-1a).
+ */
+unsigned int hash_key(const char* key)
+{
+    unsigned int h = 2166136261u;
+    for (const unsigned char* p = (const unsigned char *) key; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/**
+ * Initialize an empty table with room for |capacity| slots (rounded up to
+ * a power of 2). The table grows as needed.
+ */
+void init_table(HashTable* table, size_t capacity)
+{
+    size_t cap = 8;
+    while (cap < capacity)
+        cap *= 2;
+    table->slots = (HashSlot *) calloc(cap, sizeof(HashSlot));
+    table->capacity = cap;
+    table->size = 0;
+}
+
+
+/**
+ * Find the slot holding |key|, or the free slot where it would go.
+ */
+static HashSlot* find_slot(HashTable* table, const char* key, unsigned int hash)
+{
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].key)
+    {
+        if (table->slots[i].hash == hash && !strcmp(table->slots[i].key, key))
+            break;
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+
+/**
+ * Double the capacity of the table.
+ */
+static int grow(HashTable* table)
+{
+    HashSlot* old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+    HashSlot* slots = (HashSlot *) calloc(2 * old_capacity, sizeof(HashSlot));
+    if (!slots)
+        return -1;
+    table->slots = slots;
+    table->capacity = 2 * old_capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].key)
+            *find_slot(table, old_slots[i].key, old_slots[i].hash) = old_slots[i];
+    }
+    free(old_slots);
+    return 0;
+}
+
+
+/**
+ * Find the item stored under |key|, if any.
+ */
+void* table_find(HashTable* table, const char* key)
+{
+    return find_slot(table, key, hash_key(key))->item;
+}
+
+
+/**
+ * Store |item| under |key|, replacing any item already stored there.
+ * Returns -1 if out of memory.
+ */
+int table_insert(HashTable* table, const char* key, void* item)
+{
+    // Keep the load factor under 1/2
+    if (2 * (table->size + 1) > table->capacity && grow(table) < 0)
+        return -1;
+    unsigned int hash = hash_key(key);
+    HashSlot* slot = find_slot(table, key, hash);
+    if (!slot->key)
+        table->size++;
+    slot->hash = hash;
+    slot->key = key;
+    slot->item = item;
+    return 0;
+}
+
+
+/**
+ * Remove |key| from the table. Returns the item that was stored under it,
+ * or NULL if there was none.
+ */
+void* table_remove(HashTable* table, const char* key)
+{
+    HashSlot* slot = find_slot(table, key, hash_key(key));
+    if (!slot->key)
+        return NULL;
+    void* item = slot->item;
+    table->size--;
+
+    // Shift back the following entries of the cluster that would no longer
+    // be reachable, instead of leaving a tombstone behind
+    size_t mask = table->capacity - 1;
+    size_t hole = slot - table->slots;
+    size_t i = hole;
+    while (TRUE)
+    {
+        i = (i + 1) & mask;
+        if (!table->slots[i].key)
+            break;
+        size_t home = table->slots[i].hash & mask;
+        // Move the entry unless its home lies cyclically in (hole, i]
+        if ((i > hole && (home <= hole || home > i)) ||
+            (i < hole && (home <= hole && home > i)))
+        {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+    memset(&table->slots[hole], 0, sizeof(HashSlot));
+    return item;
+}
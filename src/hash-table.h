@@ -0,0 +1,49 @@
+#ifndef _HASH_TABLE_H_
+#define _HASH_TABLE_H_
+
+#include <stddef.h>
+
+/* Slot */
+typedef struct {
+    unsigned int hash;
+    const char* key;    // NULL if the slot is free
+    void* item;
+} HashSlot;
+
+
+/**
+ * Hash Table.
+ *
+ * An open-addressing (linear probing) table mapping string keys to items.
+ * The table does not copy keys: a key must stay valid (and unchanged) as
+ * long as it is in the table, which is easiest if it is stored in the item
+ * itself. Keys are compared exactly, so names that should match without
+ * regard to case must be folded beforehand (see |casefold()|).
+ *
+ * Example Usage
+
+     HashTable table;
+     init_table(&table, 64);
+     table_insert(&table, cli->nick_key, cli);
+     client_t* found = table_find(&table, key);
+     table_remove(&table, cli->nick_key);
+
+*/
+typedef struct {
+    HashSlot* slots;
+    size_t capacity;    // Power of 2
+    size_t size;
+} HashTable;
+
+
+unsigned int hash_key(const char* key);
+
+void init_table(HashTable* table, size_t capacity);
+
+void* table_find(HashTable* table, const char* key);
+
+int table_insert(HashTable* table, const char* key, void* item);
+
+void* table_remove(HashTable* table, const char* key);
+
+#endif /* _HASH_TABLE_H_ */
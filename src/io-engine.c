@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io-engine.h"
+#include "debug.h"
+
+
+static const io_engine_t* engines[] = {
+    &epoll_engine,
+    &uring_engine,
+};
+
+
+/**
+ * Find an I/O engine by name.
+ */
+const io_engine_t* find_engine(const char* name)
+{
+    for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+    {
+        if (!strcmp(engines[i]->name, name))
+            return engines[i];
+    }
+    return NULL;
+}
+
+
+/**
+ * Initialize an event loop serving |listenfd| with the given engine.
+ */
+int init_loop(io_loop_t* loop, int id, const io_engine_t* engine,
+              server_info_t* server_info, int listenfd)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->id = id;
+    loop->engine = engine;
+    loop->server_info = server_info;
+    loop->listenfd = listenfd;
+    // Hot and cold client records come from separate pools, so that the
+    // hot ones are packed together
+    init_pool(&loop->client_pool, "client", sizeof(client_t), POOL_SLAB_OBJS);
+    init_pool(&loop->cold_pool, "client-cold", sizeof(client_cold_t), POOL_SLAB_OBJS);
+    init_pool(&loop->partial_pool, "partial", RFC_MAX_MSG_LEN, POOL_SLAB_OBJS);
+    loop->readbuf = malloc(READBUF_SIZE);
+    if (!loop->readbuf)
+        return -1;
+    if (init_mailbox(&loop->mailbox) < 0)
+    {
+        perror("eventfd() failed");
+        return -1;
+    }
+    return engine->init(loop);
+}
+
+
+/**
+ * Record the client owning its socket, so that I/O events can be mapped
+ * back to the client.
+ */
+int loop_map_client(io_loop_t* loop, client_t* cli)
+{
+    // Grow the fd -> client map if necessary
+    if (cli->sock >= loop->fd_clients_size)
+    {
+        int new_size = MAX(cli->sock + 1, 2 * loop->fd_clients_size);
+        client_t** map = realloc(loop->fd_clients, new_size * sizeof(client_t*));
+        if (!map)
+            return -1;
+        memset(map + loop->fd_clients_size, 0,
+               (new_size - loop->fd_clients_size) * sizeof(client_t*));
+        loop->fd_clients = map;
+        loop->fd_clients_size = new_size;
+    }
+    loop->fd_clients[cli->sock] = cli;
+    return 0;
+}
+
+
+/**
+ * Forget about the client owning its socket.
+ */
+void loop_unmap_client(io_loop_t* loop, client_t* cli)
+{
+    if (cli->sock < loop->fd_clients_size &&
+        loop->fd_clients[cli->sock] == cli)
+        loop->fd_clients[cli->sock] = NULL;
+}
+
+
+/**
+ * Find the client owning socket |fd|, if any.
+ * A client that has quit earlier is no longer mapped (or its fd has been
+ * reused by a new client, which then simply gets a spurious event).
+ */
+client_t* loop_find_client(io_loop_t* loop, int fd)
+{
+    if (fd < 0 || fd >= loop->fd_clients_size)
+        return NULL;
+    return loop->fd_clients[fd];
+}
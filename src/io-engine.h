@@ -0,0 +1,68 @@
+#ifndef _IO_ENGINE_H_
+#define _IO_ENGINE_H_
+
+#include <stddef.h>
+#include "sircs.h"
+#include "mailbox.h"
+
+/**
+ * I/O engines.
+ *
+ * An engine drives an event loop: it waits for activity on the loop's
+ * listening socket, client sockets and mailbox, and hands the results back
+ * to the server through |accept_client()|, |handle_data()|,
+ * |handle_input()| or |handle_messages()|.
+ * Replies are queued on the client (see |send_outbuf()|), and the engine's
+ * |flush| operation sends them out as fast as the socket takes them.
+ *
+ * The engine is chosen at startup (see the -e option).
+ */
+typedef struct {
+    const char* name;
+    /* Set up engine state for |loop|. Returns -1 if the engine is unavailable. */
+    int  (*init)(io_loop_t* loop);
+    /* Wait for one batch of events and handle them. */
+    int  (*wait)(io_loop_t* loop);
+    /* Start/stop watching a client's socket. */
+    int  (*watch)(io_loop_t* loop, client_t* cli);
+    void (*unwatch)(io_loop_t* loop, client_t* cli);
+    /* Start sending the client's queued output (core loop only), and
+     * keep at it until the queue is empty. Returns -1 on error. */
+    int  (*flush)(io_loop_t* loop, client_t* cli);
+} io_engine_t;
+
+struct io_loop {
+    int id;                     // 0 for the core loop
+    const io_engine_t* engine;
+    void* priv;                 // Engine-specific state
+    server_info_t* server_info;
+    int listenfd;
+    Mailbox mailbox;            // Messages from the other loops
+    client_t** fd_clients;      // fd -> client lookup for I/O events
+    int fd_clients_size;
+    unsigned long accepted;     // Accept statistics (see |report_accept_stats()|)
+    unsigned long accept_errors;
+    int accept_batch_max;
+    char* readbuf;              // Input of the client being served (|READBUF_SIZE|)
+    // The clients accepted by this loop come from its own pools, and only
+    // this loop allocates and frees them (see |reap_zombies()|)
+    Pool client_pool;           // client_t
+    Pool cold_pool;             // client_cold_t
+    Pool partial_pool;          // Incomplete messages held between reads
+};
+
+extern const io_engine_t epoll_engine;
+extern const io_engine_t uring_engine;
+
+const io_engine_t* find_engine(const char* name);
+
+int init_loop(io_loop_t* loop, int id, const io_engine_t* engine,
+              server_info_t* server_info, int listenfd);
+
+int loop_map_client(io_loop_t* loop, client_t* cli);
+
+void loop_unmap_client(io_loop_t* loop, client_t* cli);
+
+client_t* loop_find_client(io_loop_t* loop, int fd);
+
+#endif /* _IO_ENGINE_H_ */
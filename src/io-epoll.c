@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>  // epoll_create1(), epoll_wait(), etc.
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_CORK
+
+#include "io-engine.h"
+#include "irc-proto.h"
+#include "debug.h"
+
+
+/**
+ * epoll engine.
+ *
+ * The listening socket and the mailbox are level-triggered (each event
+ * drains the accept queue). Client sockets are edge-triggered and registered once, so
+ * each wakeup only visits the sockets that are actually ready.
+ *
+ * Output is written directly to the socket. When the socket is full, the
+ * core loop also watches it for EPOLLOUT until the client's queue has been
+ * flushed (even if the client is served by another loop, since all the
+ * output comes from the core loop).
+ */
+
+typedef struct {
+    int epfd;
+    struct epoll_event events[MAX_EVENTS];
+} epoll_state_t;
+
+
+static int epoll_init(io_loop_t* loop)
+{
+    epoll_state_t* st = malloc(sizeof(epoll_state_t));
+    if (!st)
+        return -1;
+    st->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (st->epfd < 0)
+    {
+        perror("epoll_create1() failed");
+        free(st);
+        return -1;
+    }
+    struct epoll_event ev, ev_mb;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->listenfd;
+    memset(&ev_mb, 0, sizeof(ev_mb));
+    ev_mb.events = EPOLLIN;
+    ev_mb.data.fd = loop->mailbox.wakefd;
+    if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) < 0 ||
+        epoll_ctl(st->epfd, EPOLL_CTL_ADD, loop->mailbox.wakefd, &ev_mb) < 0)
+    {
+        perror("epoll_ctl() failed");
+        close(st->epfd);
+        free(st);
+        return -1;
+    }
+    loop->priv = st;
+    return 0;
+}
+
+
+static int epoll_flush(io_loop_t* loop, client_t* cli);
+
+
+static int epoll_wait_events(io_loop_t* loop)
+{
+    epoll_state_t* st = loop->priv;
+    server_info_t* server_info = loop->server_info;
+
+    int ready = epoll_wait(st->epfd, st->events, MAX_EVENTS, -1);
+    if (ready < 0)
+        return errno == EINTR ? 0 : -1;
+
+    DEBUG_PRINTF(DEBUG_CLIENTS, "\n");
+    for (int i = 0; i < ready; i++)
+    {
+        int fd = st->events[i].data.fd;
+        // Accept a new connection
+        if (fd == loop->listenfd)
+        {
+            handle_new_connection(loop);
+            continue;
+        }
+        // Messages from the other loops
+        if (fd == loop->mailbox.wakefd)
+        {
+            handle_messages(loop);
+            continue;
+        }
+        client_t* cli = loop_find_client(loop, fd);
+        if (!cli)
+            continue;
+        uint32_t events = st->events[i].events;
+        // Room for more output
+        if (events & EPOLLOUT)
+        {
+            if (epoll_flush(loop, cli) < 0)
+            {
+                output_failed(server_info, cli);
+                continue;
+            }
+        }
+        // Only watched for output here
+        if (cli->loop != loop || !(events & ~EPOLLOUT))
+            continue;
+        DEBUG_PRINTF(DEBUG_CLIENTS, "Active fd=%i\n", cli->sock);
+        // If something went wrong, fake a QUIT command
+        if (handle_data(server_info, cli) < 0)
+            client_hangup(server_info, cli);
+    }
+    return 0;
+}
+
+
+static int epoll_watch(io_loop_t* loop, client_t* cli)
+{
+    epoll_state_t* st = loop->priv;
+    if (loop_map_client(loop, cli) < 0)
+        return -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = cli->sock;
+    if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, cli->sock, &ev) < 0)
+    {
+        perror("epoll_ctl(EPOLL_CTL_ADD) failed");
+        loop_unmap_client(loop, cli);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void epoll_unwatch(io_loop_t* loop, client_t* cli)
+{
+    epoll_state_t* st = loop->priv;
+    epoll_ctl(st->epfd, EPOLL_CTL_DEL, cli->sock, NULL);
+    loop_unmap_client(loop, cli);
+}
+
+
+/**
+ * Watch a client's socket for EPOLLOUT (or stop watching it), on top of
+ * the input events if the client is served by this loop.
+ */
+static int epoll_want_output(io_loop_t* loop, client_t* cli, int want)
+{
+    epoll_state_t* st = loop->priv;
+    int own = cli->loop == loop;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (own ? EPOLLIN | EPOLLRDHUP : 0) | (want ? EPOLLOUT : 0) | EPOLLET;
+    ev.data.fd = cli->sock;
+    if (own)
+        return epoll_ctl(st->epfd, EPOLL_CTL_MOD, cli->sock, &ev);
+    if (!want)
+    {
+        epoll_unwatch(loop, cli);
+        return 0;
+    }
+    if (loop_map_client(loop, cli) < 0)
+        return -1;
+    return epoll_ctl(st->epfd, EPOLL_CTL_ADD, cli->sock, &ev);
+}
+
+
+static int epoll_flush(io_loop_t* loop, client_t* cli)
+{
+    // With -C, only full segments go out until the whole queue is written
+    const int cork = loop->server_info->cork;
+    if (cork)
+    {
+        const int on = 1;
+        setsockopt(cli->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+    int rc = outq_write(&cli->outq, cli->sock);
+    if (cork)
+    {
+        const int off = 0;
+        setsockopt(cli->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+    if (rc < 0)
+        return -1;
+    // Socket full => wait until it is writable again
+    if (rc == 0 && !cli->out_busy)
+    {
+        if (epoll_want_output(loop, cli, TRUE) < 0)
+            return -1;
+        cli->out_busy = TRUE;
+    }
+    else if (rc == 1 && cli->out_busy)
+    {
+        epoll_want_output(loop, cli, FALSE);
+        cli->out_busy = FALSE;
+    }
+    return 0;
+}
+
+
+const io_engine_t epoll_engine = {
+    .name    = "epoll",
+    .init    = epoll_init,
+    .wait    = epoll_wait_events,
+    .watch   = epoll_watch,
+    .unwatch = epoll_unwatch,
+    .flush   = epoll_flush,
+};
@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#include "io-engine.h"
+#include "irc-proto.h"
+#include "pool.h"
+#include "debug.h"
+
+
+/**
+ * io_uring engine.
+ *
+ * - The listening socket is served by a single multishot accept, and the
+ *   mailbox by a multishot poll.
+ * - Each client has a multishot recv, which picks its buffers from a ring
+ *   of provided buffers registered with the kernel.
+ * - Replies are sent straight from the buffers at the front of the
+ *   client's output queue by a SENDMSG (one in flight per client, to keep
+ *   them in order). The send holds references to those buffers until it
+ *   completes, so that it may outlive the client. All SQEs produced
+ *   while handling a batch of completions are submitted together by the
+ *   next io_uring_enter().
+ *
+ * Completions are matched to clients with their |user_data|, which
+ * encodes the request type, the socket and the client's serial number,
+ * so that completions for a client that has quit are recognized as stale.
+ * Sends (core loop only) keep the client's handle instead.
+ */
+
+#define URING_ENTRIES 4096
+#define URING_NBUFS   1024  // Must be a power of 2
+#define URING_BUFSZ   MAX_MSG_LEN
+#define URING_BGID    0
+#define URING_SEND_MAX (16 * 1024)  // Bytes per send
+#define URING_SEND_IOV OUTQ_CHUNK_BUFS  // Buffers per send
+
+// Request types, stored in the top byte of |user_data|.
+// Sends store a pointer to their |send_op_t| instead (top byte 0).
+#define UD_SEND   0
+#define UD_ACCEPT 1
+#define UD_RECV   2
+#define UD_CANCEL 3
+#define UD_WAKE   4
+
+#define UD(type, fd, serial) \
+    (((__u64) (type) << 56) | ((__u64) ((serial) & 0xffffff) << 32) | (__u32) (fd))
+#define UD_TYPE(ud)   ((int) ((ud) >> 56))
+#define UD_SERIAL(ud) ((unsigned) (((ud) >> 32) & 0xffffff))
+#define UD_FD(ud)     ((int) ((ud) & 0xffffffff))
+
+typedef struct send_op {
+    client_handle_t client;
+    struct msghdr msg;      // Read by the kernel until the send completes
+    int nbufs;
+    struct iovec iov[URING_SEND_IOV];
+    OutBuf* bufs[URING_SEND_IOV];  // References held by the send
+} send_op_t;
+
+typedef struct {
+    int ring_fd;
+    // Mappings, to be unmapped on failure (NULL if not mapped)
+    char *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    // Submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;      // Local tail, published on submission
+    unsigned submitted;
+    struct io_uring_sqe* sqes;
+    // SQEs that did not fit in the submission queue, in order
+    struct io_uring_sqe* backlog;
+    unsigned backlog_len, backlog_max;
+    // Completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    // Provided buffers
+    struct io_uring_buf_ring* br;
+    unsigned short br_tail;
+    char* bufs;
+    // Sends in flight
+    Pool send_pool;
+} uring_state_t;
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/**
+ * Publish the SQEs queued so far, submit them, and wait for at least
+ * |wait_nr| completions.
+ * If the kernel cannot take them yet (EBUSY while the completion queue
+ * overflows, EAGAIN when short of memory), they stay queued, nothing is
+ * waited for, and 0 is returned: they go again once the completions have
+ * been reaped.
+ */
+static int uring_submit(uring_state_t* st, unsigned wait_nr)
+{
+    __atomic_store_n(st->sq_tail, st->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = st->sqe_tail - st->submitted;
+    int rc = sys_io_uring_enter(st->ring_fd, to_submit, wait_nr,
+                                wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (rc < 0)
+        return (errno == EINTR || errno == EBUSY || errno == EAGAIN) ? 0 : -1;
+    st->submitted += rc;
+    return rc;
+}
+
+
+/**
+ * Get a blank SQE in the submission queue, or NULL if it is full.
+ */
+static struct io_uring_sqe* uring_ring_sqe(uring_state_t* st)
+{
+    unsigned head = __atomic_load_n(st->sq_head, __ATOMIC_ACQUIRE);
+    if (st->sqe_tail - head >= st->sq_entries)
+        return NULL;
+    unsigned idx = st->sqe_tail & *st->sq_mask;
+    struct io_uring_sqe* sqe = &st->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    st->sq_array[idx] = idx;
+    st->sqe_tail++;
+    return sqe;
+}
+
+
+/**
+ * Move as much of the backlog as fits into the submission queue.
+ * Returns TRUE if the backlog is now empty.
+ */
+static int uring_drain_backlog(uring_state_t* st)
+{
+    unsigned moved = 0;
+    struct io_uring_sqe* sqe;
+    while (moved < st->backlog_len && (sqe = uring_ring_sqe(st)) != NULL)
+        *sqe = st->backlog[moved++];
+    if (moved)
+    {
+        st->backlog_len -= moved;
+        memmove(st->backlog, st->backlog + moved, st->backlog_len * sizeof(*sqe));
+    }
+    return st->backlog_len == 0;
+}
+
+
+/**
+ * Get a blank SQE, submitting the queued ones first if the ring is full.
+ * If the kernel cannot take them, the SQE is kept in the backlog, to be
+ * queued (in order) by a later call or by |uring_wait()|, so that no
+ * request is ever dropped. Returns NULL only if out of memory.
+ */
+static struct io_uring_sqe* uring_get_sqe(uring_state_t* st)
+{
+    if (st->backlog_len && !uring_drain_backlog(st))
+    {
+        uring_submit(st, 0);
+        uring_drain_backlog(st);
+    }
+    if (!st->backlog_len)
+    {
+        struct io_uring_sqe* sqe = uring_ring_sqe(st);
+        if (!sqe)
+        {
+            uring_submit(st, 0);
+            sqe = uring_ring_sqe(st);
+        }
+        if (sqe)
+            return sqe;
+    }
+    if (st->backlog_len == st->backlog_max)
+    {
+        unsigned new_max = st->backlog_max ? 2 * st->backlog_max : 64;
+        struct io_uring_sqe* backlog = realloc(st->backlog, new_max * sizeof(*backlog));
+        if (!backlog)
+        {
+            perror("Cannot queue io_uring request");
+            return NULL;
+        }
+        st->backlog = backlog;
+        st->backlog_max = new_max;
+    }
+    struct io_uring_sqe* sqe = &st->backlog[st->backlog_len++];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+
+/**
+ * Hand buffer |bid| back to the kernel.
+ */
+static void uring_recycle_buffer(uring_state_t* st, unsigned short bid)
+{
+    struct io_uring_buf* buf = &st->br->bufs[st->br_tail & (URING_NBUFS - 1)];
+    buf->addr = (__u64) (unsigned long) (st->bufs + (size_t) bid * URING_BUFSZ);
+    buf->len = URING_BUFSZ;
+    buf->bid = bid;
+    st->br_tail++;
+    __atomic_store_n(&st->br->tail, st->br_tail, __ATOMIC_RELEASE);
+}
+
+
+static void uring_arm_accept(io_loop_t* loop)
+{
+    uring_state_t* st = loop->priv;
+    struct io_uring_sqe* sqe = uring_get_sqe(st);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = UD(UD_ACCEPT, loop->listenfd, 0);
+}
+
+
+static void uring_arm_wake(io_loop_t* loop)
+{
+    uring_state_t* st = loop->priv;
+    struct io_uring_sqe* sqe = uring_get_sqe(st);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->mailbox.wakefd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = UD(UD_WAKE, loop->mailbox.wakefd, 0);
+}
+
+
+static void uring_arm_recv(uring_state_t* st, client_t* cli)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(st);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = cli->sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD(UD_RECV, cli->sock, cli->serial);
+}
+
+
+static int uring_arm_send(uring_state_t* st, int fd, send_op_t* op)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(st);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (__u64) (unsigned long) &op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (__u64) (unsigned long) op;
+    return 0;
+}
+
+
+/**
+ * Find the live client a completion refers to, if any.
+ */
+static client_t* uring_find_client(io_loop_t* loop, int fd, unsigned serial)
+{
+    client_t* cli = loop_find_client(loop, fd);
+    if (!cli || (cli->serial & 0xffffff) != serial)
+        return NULL;
+    return cli;
+}
+
+
+static void uring_handle_accept(io_loop_t* loop, struct io_uring_cqe* cqe)
+{
+    if (cqe->res >= 0)
+    {
+        struct sockaddr_in cli_addr;
+        socklen_t cli_addr_len = sizeof(cli_addr);
+        memset(&cli_addr, 0, cli_addr_len);
+        // Multishot accept cannot report peer addresses
+        if (getpeername(cqe->res, (struct sockaddr *) &cli_addr, &cli_addr_len) < 0)
+        {
+            perror("getpeername() failed");
+            close(cqe->res);
+        }
+        else
+        {
+            accept_client(loop, cqe->res, &cli_addr);
+        }
+    }
+    else
+    {
+        __atomic_add_fetch(&loop->accept_errors, 1, __ATOMIC_RELAXED);
+        errno = -cqe->res;
+        perror("accept() failed");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm_accept(loop);
+}
+
+
+static void uring_handle_recv(io_loop_t* loop, struct io_uring_cqe* cqe)
+{
+    uring_state_t* st = loop->priv;
+    client_t* cli = uring_find_client(loop, UD_FD(cqe->user_data), UD_SERIAL(cqe->user_data));
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cli && cqe->res > 0)
+        {
+            DEBUG_PRINTF(DEBUG_CLIENTS, "Active fd=%i\n", cli->sock);
+            handle_input(loop->server_info, cli,
+                         st->bufs + (size_t) bid * URING_BUFSZ, cqe->res);
+        }
+        uring_recycle_buffer(st, bid);
+        // The client may have quit meanwhile
+        cli = uring_find_client(loop, UD_FD(cqe->user_data), UD_SERIAL(cqe->user_data));
+    }
+
+    if (!cli)
+        return;
+
+    // Connection closed by client (EOF), or something else went wrong
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS))
+    {
+        DEBUG_PRINTF(DEBUG_INPUT, "recv() got %d\n", cqe->res);
+        client_hangup(loop->server_info, cli);
+    }
+    // Out of provided buffers, or the multishot recv has terminated
+    else if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uring_arm_recv(st, cli);
+    }
+}
+
+
+static int uring_flush(io_loop_t* loop, client_t* cli);
+
+
+/**
+ * Drop the references held by a send, and give it back to the pool.
+ */
+static void uring_free_send(uring_state_t* st, send_op_t* op)
+{
+    for (int i = 0; i < op->nbufs; i++)
+        outbuf_unref(op->bufs[i]);
+    pool_free(&st->send_pool, op);
+}
+
+
+static void uring_handle_send(io_loop_t* loop, struct io_uring_cqe* cqe)
+{
+    send_op_t* op = (send_op_t *) (unsigned long) cqe->user_data;
+    client_t* cli = find_client(&loop->server_info->client_table, op->client);
+    uring_free_send(loop->priv, op);
+
+    // The client has quit in the meantime
+    if (!cli || cli->zombie)
+        return;
+
+    cli->out_busy = FALSE;
+    if (cqe->res < 0)
+    {
+        DEBUG_PRINTF(DEBUG_REPLIES, "send() got %d\n", cqe->res);
+        output_failed(loop->server_info, cli);
+        return;
+    }
+    // Short send => the rest is still queued
+    outq_consume(&cli->outq, cqe->res);
+    if (uring_flush(loop, cli) < 0)
+        output_failed(loop->server_info, cli);
+}
+
+
+/**
+ * mmap() a region of the ring, or return NULL.
+ */
+static void* uring_map(int fd, size_t size, off_t offset)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+
+/**
+ * Undo whatever part of |uring_init()| has been done: unmap the rings
+ * and the buffers, close the ring and free |st|.
+ */
+static void uring_free(uring_state_t* st)
+{
+    close(st->ring_fd);  // First, so that the kernel lets go of the buffers
+    free(st->bufs);
+    if (st->br)
+        munmap(st->br, URING_NBUFS * sizeof(struct io_uring_buf));
+    if (st->sqes)
+        munmap(st->sqes, st->sq_entries * sizeof(struct io_uring_sqe));
+    if (st->cq_ring && st->cq_ring != st->sq_ring)
+        munmap(st->cq_ring, st->cq_ring_size);
+    if (st->sq_ring)
+        munmap(st->sq_ring, st->sq_ring_size);
+    free(st);
+}
+
+
+static int uring_init(io_loop_t* loop)
+{
+    uring_state_t* st = calloc(1, sizeof(uring_state_t));
+    if (!st)
+        return -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    st->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (st->ring_fd < 0)
+    {
+        perror("io_uring_setup() failed");
+        free(st);
+        return -1;
+    }
+
+    // Map the rings
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = MAX(sq_size, cq_size);
+    st->sq_entries = p.sq_entries;
+    st->sq_ring_size = sq_size;
+    st->cq_ring_size = cq_size;
+    char* sq_ptr = st->sq_ring = uring_map(st->ring_fd, sq_size, IORING_OFF_SQ_RING);
+    char* cq_ptr = st->cq_ring = sq_ptr;
+    if (sq_ptr && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq_ptr = st->cq_ring = uring_map(st->ring_fd, cq_size, IORING_OFF_CQ_RING);
+    if (cq_ptr)
+        st->sqes = uring_map(st->ring_fd, p.sq_entries * sizeof(struct io_uring_sqe),
+                             IORING_OFF_SQES);
+    if (!sq_ptr || !cq_ptr || !st->sqes)
+    {
+        perror("mmap() failed");
+        uring_free(st);
+        return -1;
+    }
+    st->sq_head  = (unsigned *) (sq_ptr + p.sq_off.head);
+    st->sq_tail  = (unsigned *) (sq_ptr + p.sq_off.tail);
+    st->sq_mask  = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    st->sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+    st->sqe_tail = st->submitted = *st->sq_tail;
+    st->cq_head  = (unsigned *) (cq_ptr + p.cq_off.head);
+    st->cq_tail  = (unsigned *) (cq_ptr + p.cq_off.tail);
+    st->cq_mask  = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    st->cqes     = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+    // Register the ring of provided buffers
+    st->br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (st->br == MAP_FAILED)
+    {
+        perror("mmap() failed");
+        st->br = NULL;
+        uring_free(st);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64) (unsigned long) st->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(st->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        perror("io_uring_register(IORING_REGISTER_PBUF_RING) failed");
+        uring_free(st);
+        return -1;
+    }
+    st->bufs = malloc((size_t) URING_NBUFS * URING_BUFSZ);
+    if (!st->bufs)
+    {
+        perror("Cannot allocate receive buffers");
+        uring_free(st);
+        return -1;
+    }
+    for (unsigned short bid = 0; bid < URING_NBUFS; bid++)
+        uring_recycle_buffer(st, bid);
+    init_pool(&st->send_pool, "uring-send", sizeof(send_op_t), POOL_SLAB_OBJS);
+
+    loop->priv = st;
+    uring_arm_accept(loop);
+    uring_arm_wake(loop);
+    return 0;
+}
+
+
+static int uring_wait(io_loop_t* loop)
+{
+    uring_state_t* st = loop->priv;
+
+    // Submit everything queued during the previous batch, and wait, unless
+    // some of it is still waiting for room
+    uring_drain_backlog(st);
+    if (uring_submit(st, st->backlog_len ? 0 : 1) < 0)
+        return -1;
+
+    DEBUG_PRINTF(DEBUG_CLIENTS, "\n");
+    unsigned head = *st->cq_head;
+    while (head != __atomic_load_n(st->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe cqe = st->cqes[head & *st->cq_mask];
+        __atomic_store_n(st->cq_head, ++head, __ATOMIC_RELEASE);
+
+        switch (UD_TYPE(cqe.user_data))
+        {
+            case UD_SEND:   uring_handle_send(loop, &cqe);   break;
+            case UD_ACCEPT: uring_handle_accept(loop, &cqe); break;
+            case UD_RECV:   uring_handle_recv(loop, &cqe);   break;
+            case UD_WAKE:
+                // Messages from the other loops
+                handle_messages(loop);
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                    uring_arm_wake(loop);
+                break;
+            default: break; // Cancellations
+        }
+    }
+    return 0;
+}
+
+
+static int uring_watch(io_loop_t* loop, client_t* cli)
+{
+    uring_state_t* st = loop->priv;
+    if (loop_map_client(loop, cli) < 0)
+        return -1;
+    uring_arm_recv(st, cli);
+    return 0;
+}
+
+
+static void uring_nop_on_fd(struct io_uring_sqe* sqe, int fd)
+{
+    if (sqe->fd == fd && (sqe->opcode == IORING_OP_RECV || sqe->opcode == IORING_OP_SENDMSG))
+    {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->flags = 0;
+    }
+}
+
+
+/**
+ * Turn the requests on socket |fd| that the kernel has not taken in yet
+ * into no-ops, which complete with the same |user_data|. Once the socket is
+ * closed, its number may go to a new connection, which they would then
+ * act on. Those already submitted hold on to the socket itself.
+ */
+static void uring_forget_fd(uring_state_t* st, int fd)
+{
+    unsigned head = __atomic_load_n(st->sq_head, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != st->sqe_tail; i++)
+        uring_nop_on_fd(&st->sqes[st->sq_array[i & *st->sq_mask]], fd);
+    for (unsigned i = 0; i < st->backlog_len; i++)
+        uring_nop_on_fd(&st->backlog[i], fd);
+}
+
+
+static void uring_unwatch(io_loop_t* loop, client_t* cli)
+{
+    uring_state_t* st = loop->priv;
+
+    // The socket is about to be closed (by this loop, or by its own loop
+    // for the replies queued here)
+    uring_forget_fd(st, cli->sock);
+
+    // Cancel the multishot recv
+    struct io_uring_sqe* sqe = uring_get_sqe(st);
+    if (sqe)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UD(UD_RECV, cli->sock, cli->serial);
+        sqe->user_data = UD(UD_CANCEL, cli->sock, cli->serial);
+    }
+    // A send in flight completes on its own
+    loop_unmap_client(loop, cli);
+}
+
+
+static int uring_flush(io_loop_t* loop, client_t* cli)
+{
+    uring_state_t* st = loop->priv;
+    if (cli->out_busy || cli->outq.bytes == 0)
+        return 0;
+
+    send_op_t* op = pool_alloc(&st->send_pool);
+    if (!op)
+        return -1;
+    op->client = cli->handle;
+    op->nbufs = outq_pin(&cli->outq, op->iov, op->bufs, URING_SEND_IOV, URING_SEND_MAX);
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = op->nbufs;
+    if (uring_arm_send(st, cli->sock, op) < 0)
+    {
+        uring_free_send(st, op);
+        return -1;
+    }
+    cli->out_busy = TRUE;
+    return 0;
+}
+
+
+const io_engine_t uring_engine = {
+    .name    = "uring",
+    .init    = uring_init,
+    .wait    = uring_wait,
+    .watch   = uring_watch,
+    .unwatch = uring_unwatch,
+    .flush   = uring_flush,
+};
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -10,6 +11,9 @@
 #include "irc-proto.h"
 #include "sircs.h"
 #include "debug.h"
+#include "parse.h"
+#include "reply.h"
+#include "cmd-hash.h"
 
 #define MAX_COMMAND 16
 
@@ -21,15 +25,14 @@
  * e.g., void cmd_nick(your_client_thingy *c, char *prefix, ...)
  * or however you set it up.
  */
-#define CMD_ARGS server_info_t* server_info, client_t* cli, char **params, int nparams
+#define CMD_ARGS server_info_t* server_info, client_t* cli, slice_t* params, int nparams
 typedef void (*cmd_handler_t)(CMD_ARGS);
 #define COMMAND(cmd_name) void cmd_name(CMD_ARGS)
 
 // Server reply macro
-#define GET_SAFE_NAME(safe_name, unsafe_name) \
+#define GET_SAFE_NAME(safe_name, unsafe_slice) \
     char safe_name[RFC_MAX_NICKNAME+1]; \
-    safe_name[RFC_MAX_NICKNAME] = '\0'; \
-    strncpy(safe_name, unsafe_name, RFC_MAX_NICKNAME);
+    slice_copy(safe_name, sizeof(safe_name), unsafe_slice);
 
 // Message of the day
 #define MOTD_STR "ようこそ、OZの世界へ"
@@ -43,6 +46,9 @@ struct dispatch {
 
 #define NELMS(array) (sizeof(array) / sizeof(array[0]))
 
+// Most targets a PRIVMSG can have: "a,b,..." fits no more in a message
+#define MAX_PMSG_TARGETS (RFC_MAX_MSG_LEN / 2)
+
 /* Define the command handlers here.  This is just a quick macro
  * to make it easy to set things up */
 COMMAND(cmdNick);
@@ -53,6 +59,7 @@ COMMAND(cmdPart);
 COMMAND(cmdList);
 COMMAND(cmdPmsg);
 COMMAND(cmdWho);
+COMMAND(cmdNames);
 
 /**
  * Dispatch table.  "reg" means "user must be registered in order
@@ -68,8 +75,13 @@ struct dispatch cmds[] = {/* cmd,    reg  #parm  function usage*/
     { "LIST",    1, 0, cmdList},
     { "PRIVMSG", 1, 0, cmdPmsg},
     { "WHO",     1, 0, cmdWho},
+    { "NAMES",   1, 0, cmdNames},
 };
 
+// Commands are looked up through a perfect hash of the table above,
+// generated by cmdhash.pl (see the Makefile)
+_Static_assert(NELMS(cmds) == CMD_HASH_COUNT, "cmd-hash.h is out of date");
+
 
 /**
  * Send a reply.
@@ -78,38 +90,58 @@ struct dispatch cmds[] = {/* cmd,    reg  #parm  function usage*/
 //#define unsafe_reply(sock, fmt, ...) do { dprintf(sock, fmt, ##__VA_ARGS__); } while (0)
 //#define unsafe_vreply(sock, fmt, va) do { vdprintf(sock, fmt, va); } while (0)
 
-void vreply(server_info_t* server_info,  client_t* cli,
-            const char* restrict format, va_list args)
+/**
+ * Format a reply once, into a buffer that can be queued for any number
+ * of clients. Returns NULL on error.
+ */
+static OutBuf* vformat_reply(const char* restrict format, va_list args)
+{
+    char line[MAX_MSG_LEN+1];
+    int num_bytes = vsnprintf(line, sizeof(line), format, args);
+    if (num_bytes < 0)
+        return NULL;
+    assert(num_bytes <= RFC_MAX_MSG_LEN);
+    return new_outbuf(line, num_bytes);
+}
+
+/**
+ * Queue a formatted reply (NULL if it could not be formatted) for a
+ * client, and check errors.
+ */
+static void reply_buf(server_info_t* server_info, client_t* cli, OutBuf* buf)
 {
     if (!cli->zombie)
     {
-        // Copy args for debug printing
-        va_list args_copy;
-        va_copy(args_copy, args);
         DEBUG_PRINTF(DEBUG_REPLIES, "+--------------------------------+\n");
         DEBUG_PRINTF(DEBUG_REPLIES, "|         To: (fd=%d) %9s   |\n", cli->sock, (*cli->nick)?cli->nick:"*");
         DEBUG_PRINTF(DEBUG_REPLIES, "+--------------------------------+\n");
-        DEBUG_PRINTF(DEBUG_REPLIES, "| ");
-        DEBUG_VPRINTF(DEBUG_REPLIES, format, args_copy);
+        DEBUG_PRINTF(DEBUG_REPLIES, "| %s", buf ? buf->data : "(null)\n");
         DEBUG_PRINTF(DEBUG_REPLIES, "|                                |\n");
         DEBUG_PRINTF(DEBUG_REPLIES, "+------------------------- End --+\n\n");
-        DEBUG_PRINTF(DEBUG_REPLIES, "+------------------------- End --+\n\n");
-        va_end(args_copy);
         
-        // Write to client socket and check errors
-        size_t num_bytes = vdprintf(cli->sock, format, args);
-        assert(num_bytes <= RFC_MAX_MSG_LEN);
-        if (num_bytes < 0)
+        if (!buf || send_outbuf(server_info, cli, buf) < 0)
         {
             // Mark client as zombie, and add to the list of zombies
             cli->zombie = TRUE;
-            add_item(server_info->zombies, cli);
+            add_node(server_info->zombies, &cli->node_zombies);
             // ECHO - QUIT
             cmdQuit(server_info, cli, NULL, 0);
         }
     }
 }
 
+void vreply(server_info_t* server_info,  client_t* cli,
+            const char* restrict format, va_list args)
+{
+    if (!cli->zombie)
+    {
+        OutBuf* buf = vformat_reply(format, args);
+        reply_buf(server_info, cli, buf);
+        if (buf)
+            outbuf_unref(buf);
+    }
+}
+
 void reply(server_info_t* server_info, client_t* cli,
            const char* restrict format, ...)
 {
@@ -121,6 +153,83 @@ void reply(server_info_t* server_info, client_t* cli,
 }
 
 
+/**
+ * Replies on the hot paths (echoes, messages, and the lines of NAMES,
+ * LIST and WHO) are assembled with a |ReplyBuilder| rather than printf():
+ * the server's ":hostname " and each client's ":nick!user@hostname" are
+ * rendered once and then copied.
+ */
+
+/**
+ * Refresh the client's cached source, ":nick!user@hostname", whenever one
+ * of its parts changes.
+ */
+void update_source(client_t* cli)
+{
+    client_cold_t* cold = cli->cold;
+    ReplyBuilder rb;
+    rb_reset(&rb);
+    RB_LITERAL(&rb, ":");
+    rb_str(&rb, cli->nick);
+    RB_LITERAL(&rb, "!");
+    rb_str(&rb, cold->user);
+    RB_LITERAL(&rb, "@");
+    rb_str(&rb, cold->hostname);
+    memcpy(cold->source, rb.data, rb.len);
+    cold->source[rb.len] = '\0';
+    cold->source_len = rb.len;
+}
+
+
+/**
+ * Start a numeric reply to a client: ":hostname <numeric> <nick>".
+ */
+static void begin_numeric(ReplyBuilder* rb, server_info_t* server_info,
+                          int numeric, client_t* cli)
+{
+    rb_reset(rb);
+    rb_append(rb, server_info->prefix, server_info->prefix_len);
+    rb_numeric(rb, numeric);
+    RB_LITERAL(rb, " ");
+    rb_str(rb, *cli->nick ? cli->nick : "*");
+}
+
+
+/**
+ * Start a message on behalf of a client: ":nick!user@hostname".
+ */
+static void begin_event(ReplyBuilder* rb, client_t* cli)
+{
+    rb_reset(rb);
+    rb_append(rb, cli->cold->source, cli->cold->source_len);
+}
+
+
+/**
+ * End a built line, and turn it into a buffer (NULL if out of memory).
+ */
+static OutBuf* finish_reply(ReplyBuilder* rb)
+{
+    size_t len = rb_finish(rb);
+    return new_outbuf(rb->data, len);
+}
+
+
+/**
+ * Send a built line to a client.
+ */
+static void send_reply(server_info_t* server_info, client_t* cli, ReplyBuilder* rb)
+{
+    if (!cli->zombie)
+    {
+        OutBuf* buf = finish_reply(rb);
+        reply_buf(server_info, cli, buf);
+        if (buf)
+            outbuf_unref(buf);
+    }
+}
+
+
 /**
  * Handle a command line.
  * Mostly, this is here to do the parsing and dispatching for you.
@@ -129,23 +238,19 @@ void reply(server_info_t* server_info, client_t* cli,
  * ensured that it's a complete line (i.e., don't just pass
  * it the result of calling read()).
  * Strip the trailing newline off before calling this function.
+ * The line is |len| bytes long, and is parsed in place (see
+ * |parse_message()|): the handlers get slices of it.
  */
-void handle_line(char* line, server_info_t* server_info, client_t* cli)
+void handle_line(const char* line, size_t len, server_info_t* server_info, client_t* cli)
 {
     // Empty messages are silently iginored (as per RFC)
-    if (*line == '\0') return;
+    if (len == 0) return;
     // Target name in replies
     char* target = *cli->nick ? cli->nick : "*";
-    char *prefix = NULL, *command, *pstart, *params[MAX_MSG_TOKENS];
-    int nparams = 0;
-    char *trailing = NULL;
-    DEBUG_PRINTF(DEBUG_INPUT, "Handling line: %s\n", line);
-    command = line;
-    if (*line == ':'){
-        prefix = ++line;
-        command = strchr(prefix, ' ');
-    }
-    if (!command || *command == '\0'){
+    irc_msg_t msg;
+    DEBUG_PRINTF(DEBUG_INPUT, "Handling line: %.*s\n", (int) len, line);
+    if (parse_message(&msg, line, len) < 0)
+    {
         // ERROR - unknown command
         reply(server_info, cli,
               ":%s %d %s * :Unknown command\r\n", // CHOICE: Cannot use |command| in this message
@@ -154,332 +259,1579 @@ void handle_line(char* line, server_info_t* server_info, client_t* cli)
               target);
         return;
     }
-    while (*command == ' '){
-        *command++ = 0;
+    DEBUG_PRINTF(DEBUG_INPUT, "Prefix:  %.*s\nCommand: %.*s\nParams (%d):\n",
+                 SLICE_ARG(msg.prefix.ptr ? msg.prefix : SLICE("<none>")),
+                 SLICE_ARG(msg.command), msg.nparams);
+    for (int i = 0; i < msg.nparams; i++){
+        DEBUG_PRINTF(DEBUG_INPUT, "   %.*s\n", SLICE_ARG(msg.params[i]));
     }
-    if (*command == '\0'){
+    DEBUG_PRINTF(DEBUG_INPUT, "\n");
+    // Ignore a command if provided with a prefix different from the client's nickname
+    if (msg.prefix.ptr && *cli->nick && slice_equals(msg.prefix, cli->nick))
+    return;
+    int index = command_index(msg.command.ptr, msg.command.len);
+    if (index < 0)
+    {
         // ERROR - unknown command
+        GET_SAFE_NAME(safe_command, msg.command)
         reply(server_info, cli,
-              ":%s %d %s * :Unknown command\r\n", // CHOICE: Cannot use |command| in this message
+              ":%s %d %s %s :Unknown command\r\n",
               server_info->hostname,
-              ERR_NEEDMOREPARAMS,
+              ERR_UNKNOWNCOMMAND,
+              target,
+              safe_command);
+        return;
+    }
+    struct dispatch* cmd = &cmds[index];
+    // ERROR - the client needs to be in order to use this command
+    if (cmd->needreg && !cli->registered)
+    {
+        reply(server_info, cli,
+              ":%s %d %s :You have not registered\r\n",
+              server_info->hostname,
+              ERR_NOTREGISTERED,
               target);
+    }
+    else if (msg.nparams < cmd->minparams)
+    {
+        // ERROR - the client didn't specify enough parameters for this command
+        reply(server_info, cli,
+              ":%s %d %s %.*s :Not enough parameters\r\n",
+              server_info->hostname,
+              ERR_NEEDMOREPARAMS,
+              target,
+              SLICE_ARG(msg.command));
+    }
+    else // Call cmd_foo handler.
+    {
+        (*cmd->handler)(server_info, cli, msg.params, msg.nparams);
+    }
+    // Zombies are cleaned by the event loop (see |reap_zombies|)
+}
+
+
+/**
+ * Check if a nickname is valid
+ *
+ * <nick> ::= <letter> { <letter> | <number> | <special> }
+ */
+int is_nickname_valid(slice_t nick)
+{
+    if (nick.len == 0 || nick.len > RFC_MAX_NICKNAME)
+        return FALSE;
+    if (!CHAR_IS(nick.ptr[0], CC_LETTER))
+        return FALSE;
+    for (size_t i = 1; i < nick.len; i++)
+    {
+        if (!CHAR_IS(nick.ptr[i], CC_LETTER | CC_DIGIT | CC_SPECIAL))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+/**
+ * Check if a name starts like a channel name, i.e. cannot be a nickname.
+ */
+static int has_channel_sigil(slice_t name)
+{
+    return name.len > 0 && (name.ptr[0] == '#' || name.ptr[0] == '&');
+}
+
+
+/**
+ * Check if a channel name is valid
+ *
+ * <channel> ::=
+ * ('#' | '&') <chstring>
+ */
+int is_channel_valid(slice_t ch_name)
+{
+    if (ch_name.len > RFC_MAX_NICKNAME || !has_channel_sigil(ch_name))
+        return FALSE;
+    for (size_t i = 1; i < ch_name.len; i++)
+    {
+        if (!CHAR_IS(ch_name.ptr[i], CC_CHSTRING))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+/**
+ * Case folding of names.
+ *
+ * From RFC:
+ *   Because of IRC's scandanavian origin, the characters {}| are considered to be
+ *   the lower case equivalents of the characters []\, respectively.
+ *   This is a critical issue when determining the equivalence of two nicknames.
+ *
+ * Two names are equivalent iff they fold to the same string, which can
+ * then be used as a hash key.
+ */
+static const unsigned char fold_table[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+    0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+    0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+/**
+ * Fold the name |src| into |dst|, which must have room for |max|+1 bytes.
+ * Returns -1 (and leaves |dst| truncated) if |src| is longer than |max|.
+ */
+int casefold(char* dst, slice_t src, size_t max)
+{
+    size_t len = src.len < max ? src.len : max;
+    for (size_t i = 0; i < len; i++)
+        dst[i] = (char) fold_table[(unsigned char) src.ptr[i]];
+    dst[len] = '\0';
+    return src.len > max ? -1 : 0;
+}
+
+
+/**
+ * Find a client by nickname (without regard to case).
+ */
+client_t* find_client_by_nick(server_info_t* server_info, slice_t nick)
+{
+    char key[RFC_MAX_NICKNAME+1];
+    if (casefold(key, nick, RFC_MAX_NICKNAME) < 0)
+        return NULL; // Too long for anyone's nickname
+    return (client_t *) table_find(&server_info->nicks, key);
+}
+
+
+/**
+ * Send MOTD messages.
+ */
+void motd(server_info_t* server_info, client_t* cli)
+{
+    ReplyBuilder rb;
+    begin_numeric(&rb, server_info, RPL_MOTDSTART, cli);
+    RB_LITERAL(&rb, " :- ");
+    rb_str(&rb, server_info->hostname);
+    RB_LITERAL(&rb, " Message of the day - ");
+    send_reply(server_info, cli, &rb);
+    begin_numeric(&rb, server_info, RPL_MOTD, cli);
+    RB_LITERAL(&rb, " :- " MOTD_STR);
+    send_reply(server_info, cli, &rb);
+    begin_numeric(&rb, server_info, RPL_ENDOFMOTD, cli);
+    RB_LITERAL(&rb, " :End of /MOTD command");
+    send_reply(server_info, cli, &rb);
+}
+
+
+/**
+ * Channel members.
+ *
+ * Memberships are recorded on both sides: a channel has a dense array of
+ * its members, and a client a dense array of its channels, in no
+ * particular order, and each entry knows the index of its counterpart in
+ * the other array. A client joins or leaves a channel in O(1) (each array
+ * moves its last entry into the slot that is freed, and the index of the
+ * moved entry's counterpart is fixed up), and a broadcast is a linear scan.
+ *
+ * A member may quit in the middle of a loop over the members (when its
+ * send queue overflows), so the loop must be bracketed with
+ * |begin_members()| and |end_members()|: during a loop, removed members
+ * leave a hole (NULL), and the array is compacted once the last loop is
+ * over. Members added during a loop are not visited.
+ *
+ * Example Usage
+
+     begin_members(ch);
+     for (int i = ch->members_len - 1; i >= 0; i--)
+     {
+         client_t* member = ch->members[i].client;
+         if (!member) continue;
+         // ...
+     }
+     end_members(ch);
+
+ */
+
+/**
+ * Make room for one more element in an array of |len| elements of |size|
+ * bytes, out of |*max|. Returns -1 if out of memory.
+ */
+static int grow_array(void* array, int* max, int len, size_t size)
+{
+    if (len < *max)
+        return 0;
+    int new_max = *max ? 2 * *max : 8;
+    void* grown = realloc(*(void **) array, new_max * size);
+    if (!grown)
+        return -1;
+    *(void **) array = grown;
+    *max = new_max;
+    return 0;
+}
+
+
+/**
+ * Add a client to a channel. Returns -1 if out of memory.
+ */
+static int add_member(channel_t* ch, client_t* cli)
+{
+    if (grow_array(&ch->members, &ch->members_max, ch->members_len, sizeof(member_t)) < 0 ||
+        grow_array(&cli->chans, &cli->max_chans, cli->num_chans, sizeof(membership_t)) < 0)
+        return -1;
+    int slot = cli->num_chans++;
+    int index = ch->members_len++;
+    ch->members[index] = (member_t) { cli, slot };
+    cli->chans[slot] = (membership_t) { ch, index };
+    ch->num_members++;
+    ch->names_valid = FALSE;
+    return 0;
+}
+
+
+/**
+ * Find the slot of a channel in the client's |chans|, or -1 if the client
+ * is not a member.
+ */
+static int find_membership(client_t* cli, channel_t* ch)
+{
+    for (int i = 0; i < cli->num_chans; i++)
+    {
+        if (cli->chans[i].channel == ch)
+            return i;
+    }
+    return -1;
+}
+
+
+/**
+ * Remove a client from the members of the channel in slot |slot| of its
+ * |chans|.
+ */
+static void drop_member(client_t* cli, int slot)
+{
+    channel_t* ch = cli->chans[slot].channel;
+    int index = cli->chans[slot].member_index;
+    assert(ch->members[index].client == cli);
+    
+    membership_t moved = cli->chans[--cli->num_chans];
+    if (slot != cli->num_chans)
+    {
+        cli->chans[slot] = moved;
+        moved.channel->members[moved.member_index].chan_slot = slot;
+    }
+    
+    ch->num_members--;
+    ch->names_valid = FALSE;
+    if (ch->iterating)
+    {
+        ch->members[index].client = NULL; // See |end_members()|
         return;
     }
-    pstart = strchr(command, ' ');
-    if (pstart){
-        while (*pstart == ' ')
-        *pstart++ = '\0';
-        if (*pstart == ':'){
-            trailing = pstart;
-        } else{
-            trailing = strstr(pstart, " :");
+    member_t last = ch->members[--ch->members_len];
+    if (index != ch->members_len)
+    {
+        ch->members[index] = last;
+        last.client->chans[last.chan_slot].member_index = index;
+    }
+}
+
+
+static void begin_members(channel_t* ch)
+{
+    ch->iterating++;
+}
+
+
+/**
+ * End a loop over the members, and fill the holes left by the members
+ * removed during the last loop.
+ */
+static void end_members(channel_t* ch)
+{
+    if (--ch->iterating > 0 || ch->num_members == ch->members_len)
+        return;
+    int len = 0;
+    for (int i = 0; i < ch->members_len; i++)
+    {
+        member_t member = ch->members[i];
+        if (member.client)
+        {
+            member.client->chans[member.chan_slot].member_index = len;
+            ch->members[len++] = member;
         }
-        if (trailing){
-            while (*trailing == ' ')
-            *trailing++ = 0;
-            if (*trailing == ':')
-            *trailing++ = 0;
+    }
+    ch->members_len = len;
+}
+
+
+/**
+ * NAMES replies.
+ *
+ * The nicknames of a channel's members are sent packed, as many per
+ * RPL_NAMREPLY line as fit in a message, and the packed lines are cached
+ * in the channel until its members or their nicknames change, so that a
+ * burst of JOINs and NAMES on a big channel renders them only once.
+ */
+
+/**
+ * Longest list of nicknames that fits in a RPL_NAMREPLY line about
+ * the channel |ch_name| (whatever the nickname of the recipient).
+ */
+static size_t names_width(server_info_t* server_info, const char* ch_name)
+{
+    // ":hostname 353 <nick> = <channel> :<nicks>\r\n"
+    return RB_MAX_LEN - server_info->prefix_len - strlen(ch_name)
+        - (sizeof("353  =  :\r\n") - 1) - RFC_MAX_NICKNAME;
+}
+
+
+/**
+ * Add a nickname to packed lines no wider than |width|.
+ * Returns -1 if out of memory.
+ */
+static int pack_nick(names_t* names, size_t width, const char* nick)
+{
+    size_t len = strlen(nick);
+    if (names->len + len + 2 > names->max)
+    {
+        size_t new_max = names->max ? 2 * names->max : 256;
+        while (names->len + len + 2 > new_max)
+            new_max *= 2;
+        char* data = realloc(names->data, new_max);
+        if (!data)
+            return -1;
+        names->data = data;
+        names->max = new_max;
+    }
+    if (names->lines > 0 && names->line_len + 1 + len <= width)
+    {
+        // Add to the last line, in place of its '\n'
+        names->data[names->len - 1] = ' ';
+        names->line_len++;
+    }
+    else
+    {
+        names->lines++;
+        names->line_len = 0;
+    }
+    memcpy(names->data + names->len, nick, len);
+    names->len += len;
+    names->data[names->len++] = '\n';
+    names->line_len += len;
+    return 0;
+}
+
+
+static void clear_names(names_t* names)
+{
+    names->len = 0;
+    names->line_len = 0;
+    names->lines = 0;
+}
+
+
+/**
+ * Get the packed nicknames of the members of a channel, in the order of
+ * its member array (which members leaving reshuffle), or NULL if out of
+ * memory.
+ */
+static names_t* channel_names(server_info_t* server_info, channel_t* ch)
+{
+    if (ch->names_valid)
+        return &ch->names;
+    size_t width = names_width(server_info, ch->name);
+    clear_names(&ch->names);
+    for (int i = 0; i < ch->members_len; i++)
+    {
+        client_t* member = ch->members[i].client;
+        if (member && pack_nick(&ch->names, width, member->nick) < 0)
+            return NULL;
+    }
+    ch->names_valid = TRUE;
+    return &ch->names;
+}
+
+
+/**
+ * Send packed nicknames as RPL_NAMREPLY lines about |ch_name|, from byte
+ * |*pos| of |names| on, followed by RPL_ENDOFNAMES if |end| is set. The
+ * lines go in a single buffer of at most |room| bytes (but at least one
+ * line), and |*pos| is moved past them. Returns TRUE once all the lines,
+ * and RPL_ENDOFNAMES, have been sent.
+ */
+static int send_names(server_info_t* server_info, client_t* cli, const char* ch_name,
+                      names_t* names, size_t* pos, int end, size_t room)
+{
+    ReplyBuilder head, tail;
+    begin_numeric(&head, server_info, RPL_NAMREPLY, cli);
+    RB_LITERAL(&head, " = ");
+    rb_str(&head, ch_name);
+    RB_LITERAL(&head, " :");
+    rb_reset(&tail);
+    if (end)
+    {
+        begin_numeric(&tail, server_info, RPL_ENDOFNAMES, cli);
+        RB_LITERAL(&tail, " ");
+        rb_str(&tail, ch_name);
+        RB_LITERAL(&tail, " :End of /NAMES list");
+        rb_finish(&tail);
+    }
+    const char* data = names ? names->data : NULL;
+    size_t len = names ? names->len : 0;
+    // The names may have been packed again since the previous page
+    size_t from = MIN(*pos, len);
+    while (from > 0 && from < len && data[from - 1] != '\n')
+        from++;
+
+    // Each '\n' becomes "\r\n", after the head of the line
+    size_t size = 0, to = from;
+    int lines = 0;
+    while (to < len)
+    {
+        const char* eol = memchr(data + to, '\n', len - to);
+        size_t line_size = head.len + (eol - (data + to)) + 2;
+        if (lines > 0 && size + line_size > room)
+            break;
+        size += line_size;
+        to = eol + 1 - data;
+        lines++;
+    }
+    int with_tail = end && to == len && (lines == 0 || size + tail.len <= room);
+    if (with_tail)
+        size += tail.len;
+    *pos = to;
+    if (size == 0)
+        return to == len;
+
+    OutBuf* buf = alloc_outbuf(size);
+    if (buf)
+    {
+        char* out = buf->data;
+        const char* line = data + from;
+        for (int i = 0; i < lines; i++)
+        {
+            const char* eol = memchr(line, '\n', data + to - line);
+            memcpy(out, head.data, head.len);
+            out += head.len;
+            memcpy(out, line, eol - line);
+            out += eol - line;
+            *out++ = '\r';
+            *out++ = '\n';
+            line = eol + 1;
         }
-        do{
-            if (*pstart != '\0'){
-                params[nparams++] = pstart;
-            } else{
-                break;
-            }
-            pstart = strchr(pstart, ' ');
-            if (pstart){
-                while (*pstart == ' ')
-                *pstart++ = '\0';
-            }
-        } while (pstart != NULL && nparams < MAX_MSG_TOKENS);
+        if (with_tail)
+            memcpy(out, tail.data, tail.len);
     }
-    if (trailing && nparams < MAX_MSG_TOKENS){
-        params[nparams++] = trailing;
+    reply_buf(server_info, cli, buf);
+    if (buf)
+        outbuf_unref(buf);
+    return to == len && (!end || with_tail);
+}
+
+
+/**
+ * Remove a channel if it is empty.
+ * The channel is freed at the end of the event-loop iteration (see
+ * |reap_zombies()|), as it may still be referred to until then.
+ */
+void remove_channel_if_empty(server_info_t* server_info, channel_t* ch)
+{
+    if (ch->num_members == 0)
+    {
+        drop_node(server_info->channels, &ch->node_channels);
+        table_remove(&server_info->chan_names, ch->key);
+        ch->next_retired = server_info->retired;
+        server_info->retired = ch;
+        server_info->snapshot_valid = FALSE;
     }
-    DEBUG_PRINTF(DEBUG_INPUT, "Prefix:  %s\nCommand: %s\nParams (%d):\n",
-                 prefix ? prefix : "<none>", command, nparams);
-    int i;
-    for (i = 0; i < nparams; i++){
-        DEBUG_PRINTF(DEBUG_INPUT, "   %s\n", params[i]);
+}
+
+
+/**
+ * Remove a client from the channel in slot |slot| of its |chans|.
+ */
+void remove_client_from_channel(server_info_t* server_info, client_t* cli, int slot)
+{
+    channel_t* ch = cli->chans[slot].channel;
+    drop_member(cli, slot);
+    // Remove channel if it becomes empty
+    remove_channel_if_empty(server_info, ch);
+}
+
+
+/**
+ * Remove a client from all its channels.
+ */
+void remove_client_from_channels(server_info_t* server_info, client_t* cli)
+{
+    while (cli->num_chans > 0)
+        remove_client_from_channel(server_info, cli, cli->num_chans - 1);
+}
+
+
+/**
+ * Find a channel by name (without regard to case).
+ */
+channel_t* find_channel_by_name(server_info_t* server_info, slice_t target_name)
+{
+    char key[MAX_CHANNAME];
+    if (casefold(key, target_name, MAX_CHANNAME-1) < 0)
+        return NULL; // Too long for any channel's name
+    return (channel_t *) table_find(&server_info->chan_names, key);
+}
+
+
+/**
+ * Send the same message to every member of |ch| but |except| (if any).
+ * The message is built once, and each recipient's output queue gets
+ * a reference to it.
+ */
+static void broadcast_buf(server_info_t* server_info,
+                          channel_t*     ch,
+                          client_t*      except,
+                          OutBuf*        buf)
+{
+    begin_members(ch);
+    for (int i = ch->members_len - 1; i >= 0; i--)
+    {
+        client_t* other = ch->members[i].client;
+        if (other && other != except)
+            reply_buf(server_info, other, buf);
     }
-    DEBUG_PRINTF(DEBUG_INPUT, "\n");
-    // Ignore a command if provided with a prefix different from the client's nickname
-    if (prefix && *cli->nick && !strcmp(prefix, cli->nick))
-    return;
-    for (i = 0; i < NELMS(cmds); i++)
+    end_members(ch);
+}
+
+
+/**
+ * Send a built line to every member of |ch| but |except| (if any).
+ */
+static void broadcast(server_info_t* server_info,
+                      channel_t*     ch,
+                      client_t*      except,
+                      ReplyBuilder*  rb)
+{
+    OutBuf* buf = finish_reply(rb);
+    broadcast_buf(server_info, ch, except, buf);
+    if (buf)
+        outbuf_unref(buf);
+}
+
+
+/**
+ * Fan-out.
+ *
+ * A client's QUIT or NICK goes to its peers, i.e. the members of all its
+ * channels, and each of them must get it once, however many channels they
+ * share with the client. Each fan-out takes a new stamp, and collects the
+ * peers that do not bear it yet, stamping them as it goes: this costs one
+ * step per membership of the client's channels.
+ *
+ * The peers are collected onto a stack, and only then sent the message:
+ * sending may make a peer quit (when its send queue overflows), whose own
+ * QUIT is then fanned out on top of the stack.
+ */
+
+/**
+ * Take a new stamp, that no client bears yet.
+ */
+static unsigned int new_stamp(server_info_t* server_info)
+{
+    if (++server_info->stamp == 0)
+    {
+        // Wrapped around: clear the stamps of all clients
+        ITER_LOOP(it, server_info->clients)
+            ITER_ITEM(it, client_t, node_clients)->visit = 0;
+        server_info->stamp = 1;
+    }
+    return server_info->stamp;
+}
+
+
+/**
+ * Make room for |count| more peers on the stack. Returns -1 if out of memory.
+ */
+static int reserve_peers(server_info_t* server_info, size_t count)
+{
+    size_t needed = server_info->peers_len + count;
+    if (needed <= server_info->peers_max)
+        return 0;
+    client_t** peers = realloc(server_info->peers, 2 * needed * sizeof(client_t*));
+    if (!peers)
+        return -1;
+    server_info->peers = peers;
+    server_info->peers_max = 2 * needed;
+    return 0;
+}
+
+
+/**
+ * Push the members of |ch| that do not bear |stamp| yet onto the stack
+ * (which must have room for them), stamping them.
+ */
+static void push_members(server_info_t* server_info, channel_t* ch, unsigned int stamp)
+{
+    for (int j = 0; j < ch->members_len; j++)
     {
-        // Specified command matches with a command (case-insensitive)
-        if (!strcasecmp(cmds[i].cmd, command))
+        client_t* peer = ch->members[j].client;
+        if (peer && peer->visit != stamp)
         {
-            // ERROR - the client needs to be in order to use this command
-            if (cmds[i].needreg && !cli->registered)
-            {
-                reply(server_info, cli,
-                      ":%s %d %s :You have not registered\r\n",
-                      server_info->hostname,
-                      ERR_NOTREGISTERED,
-                      target);
-            }
-            else if (nparams < cmds[i].minparams)
-            {
-                // ERROR - the client didn't specify enough parameters for this command
-                reply(server_info, cli,
-                      ":%s %d %s %s :Not enough parameters\r\n",
-                      server_info->hostname,
-                      ERR_NEEDMOREPARAMS,
-                      target,
-                      command);
-            }
-            else // Call cmd_foo handler.
-            {
-                (*cmds[i].handler)(server_info, cli, params, nparams);
-            }
-            // Clean zombies
-            ITER_LOOP(it, server_info->zombies)
-            {
-                client_t* zombie = iter_get_item(it);
-                iter_drop_curr(it);
-                free(zombie);
-            }
-            ITER_END(it);
-            return;
+            peer->visit = stamp;
+            server_info->peers[server_info->peers_len++] = peer;
+        }
+    }
+}
+
+
+/**
+ * Push the peers of |cli| (but |cli| itself) onto the stack, stamped with
+ * a new stamp, which |cli| also gets. Returns the previous top of the stack,
+ * or -1 if out of memory.
+ */
+static ssize_t collect_peers(server_info_t* server_info, client_t* cli)
+{
+    unsigned int stamp = new_stamp(server_info);
+    cli->visit = stamp;
+    size_t base = server_info->peers_len;
+    size_t count = 0;
+    for (int i = 0; i < cli->num_chans; i++)
+        count += cli->chans[i].channel->num_members;
+    if (reserve_peers(server_info, count) < 0)
+        return -1;
+    for (int i = 0; i < cli->num_chans; i++)
+        push_members(server_info, cli->chans[i].channel, stamp);
+    return base;
+}
+
+
+/**
+ * Send a built line to every peer of |cli| (but |cli| itself), once each.
+ */
+static void fanout(server_info_t* server_info, client_t* cli, ReplyBuilder* rb)
+{
+    ssize_t base = collect_peers(server_info, cli);
+    if (base < 0)
+        return;
+    size_t end = server_info->peers_len;
+    OutBuf* buf = finish_reply(rb);
+    // The stack may grow (and move) during the loop, but not shrink below |end|
+    for (size_t i = base; i < end; i++)
+        reply_buf(server_info, server_info->peers[i], buf);
+    server_info->peers_len = base;
+    if (buf)
+        outbuf_unref(buf);
+}
+
+
+/**
+ * Streamed replies.
+ *
+ * LIST and WHO may have thousands of lines to send. They are not answered
+ * within the handler: the state of the reply is kept on the client, and
+ * the lines are sent a page at a time, for as long as the client's send
+ * queue stays under |stream_budget()|. After each tick's output has gone
+ * out, each reply in progress whose client has taken enough of it sends
+ * one more page (see |continue_streams()|). A long reply thus only ever
+ * holds up the other clients for one page per tick, and never overflows
+ * its own client's queue.
+ *
+ * A client has one reply in progress at most: a new LIST or WHO cuts the
+ * one in progress short, which still gets its final line(s).
+ */
+
+struct __stream_struct {
+    Node node_streams;       // In the server's |streams| while in progress
+    client_t* client;
+    /* Send lines until the client has |budget| bytes queued, or until
+     * there are none left (but the final ones), in which case return TRUE. */
+    int  (*next_page)(server_info_t* server_info, stream_t* st, size_t budget);
+    /* Send the final line(s) of the reply, cut short or not. */
+    void (*end)(server_info_t* server_info, stream_t* st);
+    /* Free the state of the reply. */
+    void (*destroy)(stream_t* st);
+};
+
+
+/**
+ * Most output a reply may leave queued for its client before it waits for
+ * the client to take some of it.
+ */
+static size_t stream_budget(server_info_t* server_info)
+{
+    return server_info->sendq_max / 2;
+}
+
+
+/**
+ * Cut the reply in progress of a client short, if any. Its state is only
+ * freed once replaced, or with the client, as |continue_streams()| may be
+ * standing on it.
+ */
+static void stop_stream(server_info_t* server_info, client_t* cli)
+{
+    stream_t* st = cli->cold->stream;
+    if (st && node_linked(&st->node_streams))
+    {
+        drop_node(server_info->streams, &st->node_streams);
+        if (!cli->zombie)
+            st->end(server_info, st);
+    }
+}
+
+
+/**
+ * Send the next page of a reply, and end it once there is nothing left.
+ * Returns TRUE if anything was sent.
+ */
+static int continue_stream(server_info_t* server_info, stream_t* st)
+{
+    client_t* cli = st->client;
+    size_t budget = stream_budget(server_info);
+    if (cli->outq.bytes >= budget || cli->zombie)
+        return FALSE;
+    if (st->next_page(server_info, st, budget) && !cli->zombie)
+    {
+        st->end(server_info, st);
+        drop_node(server_info->streams, &st->node_streams);
+    }
+    return TRUE;
+}
+
+
+/**
+ * Start a reply to a client, once the previous one has been stopped.
+ * Must not be called from within |continue_streams()|.
+ */
+static void start_stream(server_info_t* server_info, client_t* cli, stream_t* st)
+{
+    if (cli->cold->stream)
+        cli->cold->stream->destroy(cli->cold->stream);
+    st->client = cli;
+    cli->cold->stream = st;
+    add_node(server_info->streams, &st->node_streams);
+    continue_stream(server_info, st);
+}
+
+
+/**
+ * Send one page of each reply in progress whose client has taken enough of
+ * its output. Returns TRUE if anything was sent, in which case the output
+ * must be flushed.
+ */
+int continue_streams(server_info_t* server_info)
+{
+    int sent = FALSE;
+    ITER_LOOP(it, server_info->streams)
+    {
+        stream_t* st = ITER_ITEM(it, stream_t, node_streams);
+        if (continue_stream(server_info, st))
+            sent = TRUE;
+    }
+    return sent;
+}
+
+
+/**
+ * Check if any reply in progress could send a page right away, in which case
+ * the next tick must not wait for an event.
+ */
+int streams_ready(server_info_t* server_info)
+{
+    size_t budget = stream_budget(server_info);
+    ITER_LOOP(it, server_info->streams)
+    {
+        client_t* cli = ITER_ITEM(it, stream_t, node_streams)->client;
+        if (cli->outq.bytes < budget && !cli->zombie)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+/**
+ * Free the reply of a client, once the client is gone.
+ */
+void free_stream(client_t* cli)
+{
+    if (cli->cold->stream)
+        cli->cold->stream->destroy(cli->cold->stream);
+}
+
+
+/**
+ * LIST replies.
+ *
+ * The channels are listed from a snapshot sorted by key, which is only
+ * rebuilt, on demand, after a channel has been created or removed. A
+ * LIST that outlives its snapshot finds its place again in the new one
+ * by the key of the last channel it looked at.
+ *
+ * The ELIST conditions ">n" and "<n" (more or fewer than n users) and
+ * masks ("#cmpu*", or "!#cmpu*" to leave channels out) can be mixed in
+ * the parameter; a plain channel name is a mask that only matches itself.
+ */
+
+#define MAX_LIST_MASKS 8
+
+typedef struct {
+    slice_t mask;            // Folded, in the |masks_text| of the LIST
+    int exclude;
+} list_mask_t;
+
+typedef struct {
+    stream_t stream;
+    int min_users;           // Only channels with more users than this...
+    int max_users;           // ... and fewer than this (-1 for any number)
+    int num_masks;
+    int num_include;         // Masks that are not exclusions
+    list_mask_t masks[MAX_LIST_MASKS];
+    char masks_text[RFC_MAX_MSG_LEN];
+    int next;                // Position in the snapshot...
+    unsigned int snapshot_gen; // ... as of this build of it
+    char last_key[MAX_CHANNAME]; // Of the last channel looked at
+} list_state_t;
+
+
+static int compare_channels(const void* a, const void* b)
+{
+    return strcmp((*(channel_t* const *) a)->key, (*(channel_t* const *) b)->key);
+}
+
+
+/**
+ * Get the channels sorted by key, rebuilding the snapshot if a channel has
+ * been created or removed since it was built. Returns NULL if out of memory.
+ */
+static channel_t** channel_snapshot(server_info_t* server_info)
+{
+    if (server_info->snapshot_valid)
+        return server_info->snapshot;
+    int count = server_info->channels->size;
+    // Even with no channels, so that NULL only means out of memory
+    if (count > server_info->snapshot_max || !server_info->snapshot)
+    {
+        count = MAX(count, 1);
+        channel_t** snapshot = realloc(server_info->snapshot, count * sizeof(channel_t*));
+        if (!snapshot)
+            return NULL;
+        server_info->snapshot = snapshot;
+        server_info->snapshot_max = count;
+    }
+    int len = 0;
+    ITER_LOOP(it, server_info->channels)
+        server_info->snapshot[len++] = ITER_ITEM(it, channel_t, node_channels);
+    qsort(server_info->snapshot, len, sizeof(channel_t*), compare_channels);
+    server_info->snapshot_len = len;
+    server_info->snapshot_gen++;
+    server_info->snapshot_valid = TRUE;
+    return server_info->snapshot;
+}
+
+
+/**
+ * Find the position of the first channel of the snapshot whose key comes
+ * after |key|.
+ */
+static int seek_snapshot(server_info_t* server_info, const char* key)
+{
+    int low = 0, high = server_info->snapshot_len;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (strcmp(server_info->snapshot[mid]->key, key) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+/**
+ * Parse the number of users of a ">n" or "<n" condition, or return -1.
+ */
+static int parse_users(slice_t s)
+{
+    if (s.len == 0 || s.len > 6)
+        return -1;
+    int n = 0;
+    for (size_t i = 0; i < s.len; i++)
+    {
+        if (!CHAR_IS(s.ptr[i], CC_DIGIT))
+            return -1;
+        n = 10 * n + (s.ptr[i] - '0');
+    }
+    return n;
+}
+
+
+/**
+ * Set the conditions of a LIST from its parameter, a comma-separated list.
+ * Conditions that cannot be parsed, and masks beyond |MAX_LIST_MASKS|, are
+ * ignored.
+ */
+static void parse_list_conditions(list_state_t* st, slice_t list)
+{
+    st->min_users = -1;
+    st->max_users = -1;
+    size_t used = 0;
+    slice_t item;
+    while (next_item(&list, &item))
+    {
+        if (item.ptr[0] == '>' || item.ptr[0] == '<')
+        {
+            int users = parse_users((slice_t) { item.ptr + 1, item.len - 1 });
+            if (users < 0)
+                continue;
+            if (item.ptr[0] == '>')
+                st->min_users = users;
+            else
+                st->max_users = users;
+            continue;
+        }
+        if (st->num_masks == MAX_LIST_MASKS)
+            continue;
+        int exclude = item.ptr[0] == '!';
+        if (exclude)
+        {
+            item.ptr++;
+            item.len--;
+        }
+        // The whole parameter fits in |masks_text|, so every mask does
+        list_mask_t* m = &st->masks[st->num_masks++];
+        casefold(st->masks_text + used, item, item.len);
+        m->mask = (slice_t) { st->masks_text + used, item.len };
+        m->exclude = exclude;
+        used += item.len + 1;
+        if (!exclude)
+            st->num_include++;
+    }
+}
+
+
+/**
+ * Check if a channel meets the conditions of a LIST.
+ */
+static int list_wants(list_state_t* st, channel_t* ch)
+{
+    if (ch->num_members <= st->min_users)
+        return FALSE;
+    if (st->max_users >= 0 && ch->num_members >= st->max_users)
+        return FALSE;
+    int included = st->num_include == 0;
+    for (int i = 0; i < st->num_masks; i++)
+    {
+        if (glob_match(st->masks[i].mask, ch->key))
+        {
+            if (st->masks[i].exclude)
+                return FALSE;
+            included = TRUE;
+        }
+    }
+    return included;
+}
+
+
+static int list_next_page(server_info_t* server_info, stream_t* stream, size_t budget)
+{
+    list_state_t* st = (list_state_t *) stream;
+    client_t* cli = stream->client;
+    channel_t** snapshot = channel_snapshot(server_info);
+    if (!snapshot)
+        return TRUE;
+    if (st->snapshot_gen != server_info->snapshot_gen)
+    {
+        st->next = seek_snapshot(server_info, st->last_key);
+        st->snapshot_gen = server_info->snapshot_gen;
+    }
+
+    ReplyBuilder rb;
+    begin_numeric(&rb, server_info, RPL_LIST, cli);
+    RB_LITERAL(&rb, " ");
+    size_t head = rb.len;
+    while (st->next < server_info->snapshot_len)
+    {
+        if (cli->outq.bytes >= budget || cli->zombie)
+        {
+            if (st->next > 0)
+                strcpy(st->last_key, snapshot[st->next - 1]->key);
+            return FALSE;
         }
+        channel_t* ch = snapshot[st->next++];
+        if (!list_wants(st, ch))
+            continue;
+        rb_rewind(&rb, head);
+        rb_str(&rb, ch->name);
+        RB_LITERAL(&rb, " ");
+        rb_int(&rb, ch->num_members);
+        RB_LITERAL(&rb, " :");
+        send_reply(server_info, cli, &rb);
     }
-    if (i == NELMS(cmds)){
-        // ERROR - unknown command
-        GET_SAFE_NAME(safe_command, command)
-        reply(server_info, cli,
-              ":%s %d %s %s :Unknown command\r\n",
-              server_info->hostname,
-              ERR_UNKNOWNCOMMAND,
-              target,
-              safe_command);
-        return;
-    }
+    return TRUE;
+}
+
+
+static void list_end(server_info_t* server_info, stream_t* stream)
+{
+    ReplyBuilder rb;
+    begin_numeric(&rb, server_info, RPL_LISTEND, stream->client);
+    RB_LITERAL(&rb, " :End of /LIST");
+    send_reply(server_info, stream->client, &rb);
+}
+
+
+static void list_destroy(stream_t* stream)
+{
+    free(stream);
 }
 
 
 /**
- * Check if a character is a special character.
+ * WHO replies.
  *
- * <special> ::=
- *   '-'  |  '['  |  ']'  |  '\'  |  '`'  |  '^'  |  '{'  |  '}'
+ * The parameter is a comma-separated list of targets, each answered in
+ * turn and ended by its own RPL_ENDOFWHO:
+ *   - a channel: its members, as of when its turn comes (their handles are
+ *     copied then, so that members who join or leave meanwhile do not upset
+ *     the order);
+ *   - a nickname: the client, through the nickname index;
+ *   - a mask (with `*` or `?`): the clients whose nickname, user name or
+ *     host name matches it.
+ * Any other name only gets its RPL_ENDOFWHO, and so does a parameter that
+ * holds no name at all, as a whole.
+ * Without a parameter, WHO lists the clients who share no channel with the
+ * asker. The clients are looked at in the order of their slots in the
+ * client table, up to the highest slot ever used, which, unlike the client
+ * list, the reply can keep its place in across ticks.
  */
-#define IS_SPECIAL(c) (strchr("-[]|\\`^{}", c) != NULL)
+
+enum {
+    WHO_NEXT,                // Start the next target
+    WHO_MEMBERS,             // List |members|
+    WHO_SCAN,                // Look for matches in the client table
+};
+
+typedef struct {
+    stream_t stream;
+    int phase;
+    slice_t targets;         // Still to do, in |text|
+    slice_t target;          // In progress
+    char text[RFC_MAX_MSG_LEN];
+    int visible;             // Only list the clients sharing no channel
+    char mask[RFC_MAX_MSG_LEN]; // Folded |target|, for WHO_SCAN
+    char channel[MAX_CHANNAME]; // Name of the channel in WHO_MEMBERS
+    client_handle_t* members;   // Or, if |visible|, the clients to leave out
+    int num_members;
+    int max_members;
+    unsigned int next;       // Member or slot to look at next
+    int next_hidden;         // Next of the clients to leave out, if |visible|
+} who_state_t;
 
 
 /**
- * Check if a character is a channel character.
- *
- * <chstring> ::=
- *   <any 8bit code except SPACE, BELL, NUL, CR, LF and comma (',')>
+ * Send a WHO reply about |other|, as a member of the channel |ch_name|.
  */
-#define IS_CH_CHAR(c) (strchr(" \a\r\n,", c) == NULL)
+static void reply_who(server_info_t* server_info, client_t* cli, client_t* other,
+                      const char* ch_name)
+{
+    // RFC: <channel> <user> <host> <server> <nick> <H|G>[*][@|+] :<hopcount> <real name>
+    ReplyBuilder rb;
+    begin_numeric(&rb, server_info, RPL_WHOREPLY, cli);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, ch_name);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, other->cold->user);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, other->cold->hostname);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, server_info->hostname);
+    RB_LITERAL(&rb, " ");
+    rb_str(&rb, other->nick);
+    RB_LITERAL(&rb, " H :0 ");
+    rb_str(&rb, other->cold->realname);
+    send_reply(server_info, cli, &rb);
+}
+
 
+static void reply_end_of_who(server_info_t* server_info, client_t* cli, slice_t target)
+{
+    ReplyBuilder rb;
+    begin_numeric(&rb, server_info, RPL_ENDOFWHO, cli);
+    RB_LITERAL(&rb, " ");
+    rb_slice(&rb, target);
+    RB_LITERAL(&rb, " :End of /WHO list");
+    send_reply(server_info, cli, &rb);
+}
 
 
 /**
- * Check if a nickname is valid
- *
- * <nick> ::= <letter> { <letter> | <number> | <special> }
+ * Check if any of the nickname, user name and host name of a client
+ * matches a (folded) mask.
  */
-int is_nickname_valid(char* nick)
+static int who_matches(slice_t mask, client_t* other)
 {
-    if (*nick == '\0')
-    return FALSE;
-    for (int i = 0; i < RFC_MAX_NICKNAME + 1; i++)
-    {
-        if (nick[i] == '\0') return TRUE;
-        if (i == RFC_MAX_NICKNAME) return FALSE;
-        char c = nick[i];
-        if ( (i == 0 && !isalpha(c)) ||
-            (i > 0  && !(isalpha(c) || isdigit(c) || IS_SPECIAL(c))))
-        {
-            return FALSE;
-        }
-    }
-    return FALSE;
+    char folded[MAX_HOSTNAME];
+    if (glob_match(mask, other->nick_key))
+        return TRUE;
+    casefold(folded, SLICE(other->cold->user), sizeof(folded) - 1);
+    if (glob_match(mask, folded))
+        return TRUE;
+    casefold(folded, SLICE(other->cold->hostname), sizeof(folded) - 1);
+    return glob_match(mask, folded);
+}
+
+
+static int compare_slots(const void* a, const void* b)
+{
+    unsigned int x = ((const client_handle_t *) a)->slot;
+    unsigned int y = ((const client_handle_t *) b)->slot;
+    return (x > y) - (x < y);
 }
 
 
 /**
- * Check if a channel name is valid
- *
- * <channel> ::=
- * ('#' | '&') <chstring>
+ * For a WHO without a parameter, remember once and for all which clients
+ * it leaves out: those sharing a channel with the asker, and the asker
+ * if on any channel. They are sorted by slot, like the scan of the client
+ * table. Returns -1 if out of memory.
  */
-int is_channel_valid(char* ch_name)
+static int who_hide_peers(server_info_t* server_info, who_state_t* st)
 {
-    if ( *ch_name != '#' && *ch_name != '&' )
-    return FALSE;
-    for (int i = 1; i < RFC_MAX_NICKNAME + 1; i++)
+    client_t* cli = st->stream.client;
+    if (!cli->num_chans)
+        return 0;
+    ssize_t base = collect_peers(server_info, cli);
+    if (base < 0)
+        return -1;
+    size_t count = server_info->peers_len - base + 1;
+    st->members = malloc(count * sizeof(client_handle_t));
+    if (!st->members)
     {
-        if (ch_name[i] == '\0') return TRUE;
-        if (i == RFC_MAX_NICKNAME) return FALSE;
-        if (!IS_CH_CHAR(ch_name[i])) return FALSE;
+        server_info->peers_len = base;
+        return -1;
     }
-    return FALSE; // Never reached
+    st->members[0] = cli->handle;
+    for (size_t i = base; i < server_info->peers_len; i++)
+        st->members[i - base + 1] = server_info->peers[i]->handle;
+    server_info->peers_len = base;
+    st->num_members = st->max_members = count;
+    qsort(st->members, count, sizeof(client_handle_t), compare_slots);
+    return 0;
 }
 
 
 /**
- * Check if two chars are equivalent
- *
- * From RFC:
- *   Because of IRC's scandanavian origin, the characters {}| are considered to be
- *   the lower case equivalents of the characters []\, respectively.
- *   This is a critical issue when determining the equivalence of two nicknames.
+ * Check if a WHO without a parameter leaves out |other|. The clients must
+ * be asked about in the order of their slots.
  */
-int equivalent_char(char a, char b)
+static int who_hidden(who_state_t* st, client_t* other)
 {
-    if (a == b) return TRUE;
-    switch (a)
-    {
-            case '{': return b == '[';
-            case '}': return b == ']';
-            case '[': return b == '{';
-            case ']': return b == '}';
-            case '|': return b == '\\';
-            case '\\': return b == '|';
-        default: return FALSE;
-    }
+    while (st->next_hidden < st->num_members &&
+           st->members[st->next_hidden].slot < other->handle.slot)
+        st->next_hidden++;
+    // The slot may have been given to somebody else since
+    return st->next_hidden < st->num_members &&
+           st->members[st->next_hidden].slot == other->handle.slot &&
+           st->members[st->next_hidden].gen == other->handle.gen;
 }
 
 
 /**
- * Check if two nicknames |this| and |that| collide.
+ * Set up the next target of a WHO, and answer it at once if it takes a
+ * single lookup. Returns -1 if out of memory.
  */
-int check_collision(char* this, char* that)
+static int start_who_target(server_info_t* server_info, who_state_t* st)
 {
-    for (int i = 0; i < RFC_MAX_NICKNAME; i++)
+    client_t* cli = st->stream.client;
+    slice_t target = st->target;
+    st->next = 0;
+    if (is_channel_valid(target))
     {
-        char ai = this[i], bi = that[i];
-        // Same length && equiv chars so far => same string
-        if ( ai == '\0' && bi == '\0')
-        return 1;
-        // Different length
-        else if ( (ai == '\0') ^ (bi == '\0') )
+        channel_t* ch = find_channel_by_name(server_info, target);
+        if (!ch)
+            return 0;
+        st->num_members = 0;
+        for (int i = 0; i < ch->members_len; i++)
+        {
+            client_t* other = ch->members[i].client;
+            if (!other)
+                continue;
+            if (grow_array(&st->members, &st->max_members, st->num_members,
+                           sizeof(client_handle_t)) < 0)
+                return -1;
+            st->members[st->num_members++] = other->handle;
+        }
+        strcpy(st->channel, ch->name);
+        st->phase = WHO_MEMBERS;
         return 0;
-        // Non-equivalent chars
-        else if ( !equivalent_char(ai, bi) )
+    }
+    if (!memchr(target.ptr, '*', target.len) && !memchr(target.ptr, '?', target.len))
+    {
+        client_t* other = find_client_by_nick(server_info, target);
+        if (other && other->registered)
+            reply_who(server_info, cli, other,
+                      other->num_chans ? other->chans[0].channel->name : "*");
         return 0;
     }
-    // End of both strings => the same len and equiv chars
-    return 1;
+    casefold(st->mask, target, target.len);
+    st->phase = WHO_SCAN;
+    return 0;
 }
 
 
 /**
- * Send MOTD messages.
+ * Go on listing the members of a channel. Returns TRUE once done.
  */
-void motd(server_info_t* server_info, client_t* cli, char* hostname)
+static int who_members(server_info_t* server_info, who_state_t* st, size_t budget)
 {
-    reply(server_info, cli,
-          ":%s %d %s :- %s Message of the day - \r\n",
-          hostname,
-          RPL_MOTDSTART,
-          cli->nick,
-          hostname);
-    reply(server_info, cli,
-          ":%s %d %s :- %s\r\n",
-          hostname,
-          RPL_MOTD,
-          cli->nick,
-          MOTD_STR);
-    reply(server_info, cli,
-          ":%s %d %s :End of /MOTD command\r\n",
-          hostname,
-          RPL_ENDOFMOTD,
-          cli->nick);
+    client_t* cli = st->stream.client;
+    while (st->next < st->num_members)
+    {
+        if (cli->outq.bytes >= budget || cli->zombie)
+            return FALSE;
+        client_t* other = find_client(&server_info->client_table, st->members[st->next++]);
+        if (other && !other->zombie)
+            reply_who(server_info, cli, other, st->channel);
+    }
+    return TRUE;
 }
 
 
 /**
- * Remove a channel if it is empty.
+ * Go on looking for the clients that match the mask (or, for a WHO without
+ * a parameter, are visible) through the client table. Returns TRUE once done.
  */
-void remove_channel_if_empty(server_info_t* server_info, channel_t* ch)
+static int who_scan(server_info_t* server_info, who_state_t* st, size_t budget)
 {
-    if (ch->members->size == 0)
+    client_t* cli = st->stream.client;
+    ClientTable* table = &server_info->client_table;
+    slice_t mask = { st->mask, st->target.len };
+    while (st->next < table->high_water)
     {
-        drop_node(server_info->channels, ch->node_channels);
-        free(ch->members);
-        free(ch);
+        if (cli->outq.bytes >= budget || cli->zombie)
+            return FALSE;
+        client_t* other = table->clients[st->next++];
+        if (!other || other->zombie || !other->registered)
+            continue;
+        if (st->visible ? who_hidden(st, other) : !who_matches(mask, other))
+            continue;
+        // The first of their channels, if any
+        reply_who(server_info, cli, other,
+                  other->num_chans ? other->chans[0].channel->name : "*");
     }
+    return TRUE;
 }
 
 
-/**
- * Remove a client from a channel.
- */
-void remove_client_from_channel(server_info_t* server_info, client_t* cli)
+static int who_next_page(server_info_t* server_info, stream_t* stream, size_t budget)
 {
-    if (cli->channel)
+    who_state_t* st = (who_state_t *) stream;
+    client_t* cli = stream->client;
+    while (TRUE)
     {
-        // Remove client from the channel member list
-        drop_node(cli->channel->members, cli->node_members);
-        // Remove channel if it becomes empty
-        remove_channel_if_empty(server_info, cli->channel);
+        if (st->phase == WHO_NEXT)
+        {
+            if (!next_item(&st->targets, &st->target))
+                return TRUE;
+            if (start_who_target(server_info, st) < 0)
+            {
+                reply_end_of_who(server_info, cli, st->target);
+                return TRUE;
+            }
+        }
+        if (st->phase == WHO_MEMBERS && !who_members(server_info, st, budget))
+            return FALSE;
+        if (st->phase == WHO_SCAN && !who_scan(server_info, st, budget))
+            return FALSE;
+        st->phase = WHO_NEXT;
+        reply_end_of_who(server_info, cli, st->target);
+        if (cli->outq.bytes >= budget || cli->zombie)
+            return FALSE;
     }
 }
 
 
 /**
- * Find a channel by name.
+ * End a WHO: if it was cut short, each target not done yet gets its
+ * RPL_ENDOFWHO.
  */
-channel_t* find_channel_by_name(server_info_t* server_info, char* target_name)
+static void who_end(server_info_t* server_info, stream_t* stream)
 {
-    channel_t* ch_found = NULL;
-    
-    ITER_LOOP(it, server_info->channels)
+    who_state_t* st = (who_state_t *) stream;
+    if (st->phase != WHO_NEXT)
+        reply_end_of_who(server_info, stream->client, st->target);
+    while (next_item(&st->targets, &st->target))
+        reply_end_of_who(server_info, stream->client, st->target);
+    // The members of a large channel are not worth keeping
+    free(st->members);
+    st->members = NULL;
+    st->max_members = 0;
+}
+
+
+static void who_destroy(stream_t* stream)
+{
+    free(((who_state_t *) stream)->members);
+    free(stream);
+}
+
+
+/**
+ * Streamed NAMES replies.
+ *
+ * A NAMES (or the names sent on JOIN) that does not fit in what is left of
+ * the client's budget goes on in a stream, which may stop in the middle of
+ * a channel and take it up again from the same place. Channels named while
+ * such a reply is in progress are queued behind it, so that the replies
+ * stay in order, and each is looked up again when its turn comes.
+ *
+ * Without a parameter, every channel is listed from the snapshot sorted by
+ * key, like a LIST, then the registered clients who are on no channel, as
+ * if on channel "*", in the order of their slots in the client table. A
+ * single RPL_ENDOFNAMES about "*" ends the whole reply.
+ */
+
+#define MAX_NAMES_QUEUED 64
+
+enum {
+    NAMES_TARGETS,           // Named channels
+    NAMES_CHANNELS,          // All channels
+    NAMES_CLIENTS,           // Clients on no channel
+};
+
+typedef struct {
+    stream_t stream;
+    int phase;
+    int all;                 // NAMES without a parameter
+    char (*targets)[MAX_CHANNAME]; // Named channels, still to do...
+    int num_targets;
+    int max_targets;
+    int next_target;         // ... from this one on
+    size_t pos;              // Into the packed names of the current channel
+    int next;                // Position in the snapshot, or slot
+    unsigned int snapshot_gen; // As of this build of the snapshot
+    char last_key[MAX_CHANNAME]; // Of the last channel done
+    char key[MAX_CHANNAME];  // Of the channel in progress, if |pos| > 0
+    names_t names;           // Clients on no channel, not sent yet
+} names_state_t;
+
+
+static int names_next_page(server_info_t* server_info, stream_t* stream, size_t budget);
+
+
+/**
+ * Get the NAMES reply of a client that channels can still be queued
+ * behind, if any.
+ */
+static names_state_t* names_in_progress(client_t* cli)
+{
+    stream_t* st = cli->cold->stream;
+    if (!st || !node_linked(&st->node_streams) || st->next_page != names_next_page)
+        return NULL;
+    names_state_t* names = (names_state_t *) st;
+    return names->all ? NULL : names;
+}
+
+
+static int names_targets_page(server_info_t* server_info, names_state_t* st, size_t budget)
+{
+    client_t* cli = st->stream.client;
+    while (st->next_target < st->num_targets)
+    {
+        if (cli->outq.bytes >= budget || cli->zombie)
+            return FALSE;
+        const char* name = st->targets[st->next_target];
+        channel_t* ch = find_channel_by_name(server_info, SLICE(name));
+        if (!send_names(server_info, cli, ch ? ch->name : name,
+                        ch ? channel_names(server_info, ch) : NULL,
+                        &st->pos, TRUE, budget - cli->outq.bytes))
+            return FALSE;
+        st->pos = 0;
+        st->next_target++;
+    }
+    return TRUE;
+}
+
+
+static int names_channels_page(server_info_t* server_info, names_state_t* st, size_t budget)
+{
+    client_t* cli = st->stream.client;
+    channel_t** snapshot = channel_snapshot(server_info);
+    if (!snapshot)
+        return TRUE;
+    if (st->snapshot_gen != server_info->snapshot_gen)
+    {
+        st->next = seek_snapshot(server_info, st->last_key);
+        st->snapshot_gen = server_info->snapshot_gen;
+    }
+    while (st->next < server_info->snapshot_len)
     {
-        channel_t* ch = (channel_t *) iter_get_item(it);
-        if ( !strncmp(target_name, ch->name, RFC_MAX_NICKNAME+1) )
+        if (cli->outq.bytes >= budget || cli->zombie)
+            return FALSE;
+        channel_t* ch = snapshot[st->next];
+        // The channel in progress may be gone
+        if (st->pos > 0 && strcmp(ch->key, st->key) != 0)
+            st->pos = 0;
+        if (!send_names(server_info, cli, ch->name, channel_names(server_info, ch),
+                        &st->pos, FALSE, budget - cli->outq.bytes))
         {
-            ch_found = ch;
-            break;
+            strcpy(st->key, ch->key);
+            return FALSE;
         }
-    } /* Iterator loop */
-    ITER_END(it);
-    
-    return ch_found;
+        strcpy(st->last_key, ch->key);
+        st->pos = 0;
+        st->next++;
+    }
+    return TRUE;
+}
+
+
+static int names_clients_page(server_info_t* server_info, names_state_t* st, size_t budget)
+{
+    // The nicknames are packed up to what is left of the budget, so that
+    // the lines stay full across pages
+    client_t* cli = st->stream.client;
+    ClientTable* table = &server_info->client_table;
+    size_t width = names_width(server_info, "*");
+    while (st->next < table->high_water)
+    {
+        if (cli->outq.bytes + st->names.len >= budget || cli->zombie)
+        {
+            size_t pos = 0;
+            send_names(server_info, cli, "*", &st->names, &pos, FALSE, SIZE_MAX);
+            clear_names(&st->names);
+            return FALSE;
+        }
+        client_t* other = table->clients[st->next++];
+        if (other && other->registered && !other->zombie && !other->num_chans &&
+            pack_nick(&st->names, width, other->nick) < 0)
+            return TRUE;
+    }
+    return TRUE;
+}
+
+
+static int names_next_page(server_info_t* server_info, stream_t* stream, size_t budget)
+{
+    names_state_t* st = (names_state_t *) stream;
+    if (st->phase == NAMES_TARGETS)
+    {
+        if (!names_targets_page(server_info, st, budget))
+            return FALSE;
+        if (!st->all)
+            return TRUE;
+        st->phase = NAMES_CHANNELS;
+    }
+    if (st->phase == NAMES_CHANNELS)
+    {
+        if (!names_channels_page(server_info, st, budget))
+            return FALSE;
+        st->phase = NAMES_CLIENTS;
+        st->next = 0;
+    }
+    return names_clients_page(server_info, st, budget);
 }
 
 
 /**
- * Echo a message to all members in the client's channel (if any),
- * including the client him/herself if |echo_to_themselves| is set to TRUE.
+ * End a NAMES, whether it is done or cut short: each channel not done yet
+ * gets its RPL_ENDOFNAMES, or, without a parameter, "*" gets the clients
+ * on no channel that have not been sent yet, and its RPL_ENDOFNAMES.
  */
-void echo_message(server_info_t* server_info,
-                  client_t*      cli,
-                  int            echo_to_themselves,
-                  const char* restrict format, ...)
+static void names_end(server_info_t* server_info, stream_t* stream)
 {
-    // Retrieve args after |format|
-    va_list args, args_copy;
-    va_start(args, format);
-    
-    if (cli->channel)
+    names_state_t* st = (names_state_t *) stream;
+    client_t* cli = stream->client;
+    size_t pos = 0;
+    for (; st->next_target < st->num_targets; st->next_target++)
+        send_names(server_info, cli, st->targets[st->next_target], NULL, &pos, TRUE, SIZE_MAX);
+    if (st->all)
+        send_names(server_info, cli, "*", &st->names, &pos, TRUE, SIZE_MAX);
+    free(st->names.data);
+    memset(&st->names, 0, sizeof(st->names));
+}
+
+
+static void names_destroy(stream_t* stream)
+{
+    names_state_t* st = (names_state_t *) stream;
+    free(st->targets);
+    free(st->names.data);
+    free(st);
+}
+
+
+/**
+ * Send the names of a channel (for NAMES or JOIN): at once if they fit in
+ * the client's budget, or else through a stream, in turn after the names
+ * already queued.
+ */
+static void reply_names(server_info_t* server_info, client_t* cli, slice_t ch_name)
+{
+    char name[MAX_CHANNAME];
+    slice_copy(name, sizeof(name), ch_name);
+    size_t budget = stream_budget(server_info);
+    size_t pos = 0;
+    names_state_t* st = names_in_progress(cli);
+    stream_t* other = cli->cold->stream;
+    if (!st)
     {
-        // Loop through the channel members
-        ITER_LOOP(it, cli->channel->members)
+        channel_t* ch = find_channel_by_name(server_info, ch_name);
+        const char* safe_name = ch ? ch->name : name;
+        names_t* names = ch ? channel_names(server_info, ch) : NULL;
+        if (other && node_linked(&other->node_streams))
         {
-            client_t* other = (client_t *) iter_get_item(it);
-            // Echo message
-            if (other != cli || echo_to_themselves)
-            {
-                va_copy(args_copy, args);
-                vreply(server_info, other, format, args);
-                va_copy(args, args_copy);
-            }
-        } /* Iterator loop */
-        ITER_END(it);
+            // CHOICE: another reply in progress is not cut short for this;
+            // the names are sent at once, in pieces of the budget
+            while (!cli->zombie &&
+                   !send_names(server_info, cli, safe_name, names, &pos, TRUE, budget))
+                ;
+            return;
+        }
+        if (cli->outq.bytes < budget &&
+            send_names(server_info, cli, safe_name, names,
+                       &pos, TRUE, budget - cli->outq.bytes))
+            return;
+        // The rest goes on from |pos|
+    }
+
+    int queued = st != NULL;
+    if (!st)
+    {
+        st = calloc(1, sizeof(names_state_t));
+        if (!st)
+            return;
+        st->stream.next_page = names_next_page;
+        st->stream.end = names_end;
+        st->stream.destroy = names_destroy;
+        st->pos = pos;
+    }
+    if (st->num_targets - st->next_target >= MAX_NAMES_QUEUED ||
+        grow_array(&st->targets, &st->max_targets, st->num_targets, MAX_CHANNAME) < 0)
+    {
+        // CHOICE: a client that queues more than that only gets the ends
+        pos = 0;
+        send_names(server_info, cli, name, NULL, &pos, TRUE, SIZE_MAX);
+        if (!queued)
+            names_destroy(&st->stream);
+        return;
+    }
+    strcpy(st->targets[st->num_targets++], name);
+    if (!queued)
+    {
+        stop_stream(server_info, cli);
+        start_stream(server_info, cli, &st->stream);
     }
-    // Else, the client isn't in any channel => Do nothing
-    
-    // Clean va_list
-    va_end(args);
-    va_end(args_copy);
 }
 
 
@@ -513,57 +1865,54 @@ void cmdNick(CMD_ARGS)
     else /* nick valid */
     {
         // Check for nickname collision
-        char* nick = params[0];
-        ITER_LOOP(it, server_info->clients)
+        // CHOICE: we do not check |registered| here,
+        // because two unregistered clients may still have colliding nicknames
+        slice_t nick = params[0];
+        char nick_key[RFC_MAX_NICKNAME+1];
+        casefold(nick_key, nick, RFC_MAX_NICKNAME);
+        client_t* other = (client_t *) table_find(&server_info->nicks, nick_key);
+        if (other && other != cli)
         {
-            client_t* other = (client_t *) iter_get_item(it);
-            if (other != cli &&
-                *other->nick &&
-                // CHOICE: we do not check |registered| here,
-                // because two unregistered clients may still have colliding nicknames
-                check_collision(nick, other->nick))
-            {
-                // ERROR - Nickname collision
-                reply(server_info, cli,
-                      ":%s %d %s %s :Nickname is already in use\r\n",
-                      server_info->hostname,
-                      ERR_NICKNAMEINUSE,
-                      *cli->nick? cli->nick: "*",
-                      nick);
-                ITER_END(it);
-                return;
-            }
+            // ERROR - Nickname collision
+            reply(server_info, cli,
+                  ":%s %d %s %.*s :Nickname is already in use\r\n",
+                  server_info->hostname,
+                  ERR_NICKNAMEINUSE,
+                  *cli->nick? cli->nick: "*",
+                  SLICE_ARG(nick));
+            return;
         }
-        ITER_END(it);
         
         /* No collision */
         
-        // Make a copy of old nickname, if any
-        char old_nick[RFC_MAX_NICKNAME+1];
-        old_nick[RFC_MAX_NICKNAME] = '\0';
-        if (*cli->nick)
-        strcpy(old_nick, cli->nick);
+        // The echo goes out under the old nickname, if any
+        ReplyBuilder rb;
+        begin_event(&rb, cli);
+        RB_LITERAL(&rb, " NICK ");
+        rb_slice(&rb, nick);
         
-        // Set client's nickname
-        strcpy(cli->nick, nick); // CHOICE: new nick same as old nick => No effect
+        // Set client's nickname, and index it by its folded form
+        if (*cli->nick)
+            table_remove(&server_info->nicks, cli->nick_key);
+        slice_copy(cli->nick, sizeof(cli->nick), nick); // CHOICE: new nick same as old nick => No effect
+        strcpy(cli->nick_key, nick_key);
+        table_insert(&server_info->nicks, cli->nick_key, cli);
+        update_source(cli);
+        for (int i = 0; i < cli->num_chans; i++)
+            cli->chans[i].channel->names_valid = FALSE;
         
-        // If user already is in a channel,
-        // ECHO - NICK to everyone else in the same channel
-        if (cli->channel)
+        // If user already is in channels,
+        // ECHO - NICK to everyone else in them, once each
+        if (cli->num_chans > 0)
         {
-            echo_message(server_info, cli, FALSE,
-                         ":%s!%s@%s NICK %s\r\n",
-                         old_nick,
-                         cli->user,
-                         cli->hostname,
-                         cli->nick);
+            fanout(server_info, cli, &rb);
         }
         // Otherwise, the client is not any channel
         // => Register the client if possible
-        else if (!cli->registered && *cli->user)
+        else if (!cli->registered && *cli->cold->user)
         {
             cli->registered = 1;
-            motd(server_info, cli, server_info->hostname);
+            motd(server_info, cli);
         }
     } /* nick valid */
 }
@@ -583,8 +1932,9 @@ void cmdUser(CMD_ARGS){
               cli->nick);
     }
     // Update user information
-    strncpy(cli->user, params[0], MAX_USERNAME-1);
-    strncpy(cli->realname, params[3], MAX_REALNAME-1);
+    slice_copy(cli->cold->user, MAX_USERNAME, params[0]);
+    slice_copy(cli->cold->realname, MAX_REALNAME, params[3]);
+    update_source(cli);
     
     // CHOICE:
     // If the client is not registered but already has already issued USER, i.e.,
@@ -595,7 +1945,7 @@ void cmdUser(CMD_ARGS){
     if (!cli->registered && *cli->nick)
     {
         cli->registered = 1;
-        motd(server_info, cli, server_info->hostname);
+        motd(server_info, cli);
     }
 }
 
@@ -605,10 +1955,9 @@ void cmdUser(CMD_ARGS){
  *
  * In this function, we
  *   1. Mark the client as zombie
- *   2. Remove the client from its channel (if any), and remove the channel if it becomes empty
- *   3. Echo QUIT message to everyone else in the same channel (if any)
- *   4. Set client's channel to NULL.
- *   5. Close the socket.
+ *   2. Echo QUIT message to everyone else in the client's channels, once each
+ *   3. Remove the client from its channels, and remove those that become empty
+ *   4. Close the socket.
  */
 void cmdQuit(CMD_ARGS)
 {
@@ -617,26 +1966,27 @@ void cmdQuit(CMD_ARGS)
     if (!cli->zombie)
     {
         cli->zombie = TRUE;
-        add_item(server_info->zombies, cli);
+        add_node(server_info->zombies, &cli->node_zombies);
     }
     // Else, the command was faked by the server,
     // in which case the client has already been duly marked as a zombie.
     
-    remove_client_from_channel(server_info, cli);
-    // ECHO - QUIT to channel members
-    echo_message(server_info, cli, FALSE,
-                 ":%s!%s@%s QUIT :Connection closed\r\n",
-                 cli->nick,
-                 cli->user,
-                 cli->hostname);
-    cli->channel = NULL;
-    // Remove client from the server's client list
-    drop_node(server_info->clients, cli->node_clients);
-    // Close the connection
-    close(cli->sock);
+    // ECHO - QUIT to the members of the client's channels
+    ReplyBuilder rb;
+    begin_event(&rb, cli);
+    RB_LITERAL(&rb, " QUIT :Connection closed");
+    fanout(server_info, cli, &rb);
+    remove_client_from_channels(server_info, cli);
+    stop_stream(server_info, cli);
+    // Remove client from the server's client list, and its nickname
+    drop_node(server_info->clients, &cli->node_clients);
+    if (*cli->nick)
+        table_remove(&server_info->nicks, cli->nick_key);
+    // Stop watching and close the connection
+    release_client(server_info, cli);
     
-    // free(cli) is done after a handler returns to handle_line,
-    // during the zombie-cleaning stage
+    // free(cli) is done by the event loop once all ready sockets
+    // have been handled, during the zombie-cleaning stage
 }
 
 
@@ -645,85 +1995,56 @@ void cmdQuit(CMD_ARGS)
  */
 void cmdJoin(CMD_ARGS)
 {
-    // CHOICE: If there is a list of targets, pick the first one and ignore the rest
-    char* channel_to_join = params[0];
-    char* comma = strchr(channel_to_join, ',');
-    if (comma)
-        *comma = '\0'; // Replace ',' with '\0' to take only the first channel name
-    
-    if ( !is_channel_valid(channel_to_join) )
-    {
-        GET_SAFE_NAME(chname_safe, channel_to_join);
-        reply(server_info, cli,
-              ":%s %d %s %s :No such channel\r\n",
-              server_info->hostname,
-              ERR_NOSUCHCHANNEL,
-              cli->nick,
-              chname_safe);
-    }
-    else /* Channel name valid */
+    slice_t ch_list = params[0], channel_to_join;
+    // Stop if the client quits in the middle of the list
+    while (!cli->zombie && next_item(&ch_list, &channel_to_join))
     {
-        channel_t* ch_found = find_channel_by_name(server_info, channel_to_join);
-        if (cli->channel) // Client was previously in a channel
+        if ( !is_channel_valid(channel_to_join) )
         {
-            // Join a channel of which the client is already a member => Do nothing
-            if ( ch_found && !strcmp(cli->channel->name, ch_found->name) ) return;
-            // ECHO - QUIT to members of the previous channel
-            // (but client still connected, so cannot reuse cmdQuit)
-            echo_message(server_info, cli, TRUE,
-                         ":%s!%s@%s QUIT :Client left channel\r\n", // CHOICE: The joiner also gets back QUIT
-                         cli->nick,
-                         cli->user,
-                         cli->hostname);
-            remove_client_from_channel(server_info, cli);
-            cli->channel = NULL;
+            GET_SAFE_NAME(chname_safe, channel_to_join);
+            reply(server_info, cli,
+                  ":%s %d %s %s :No such channel\r\n",
+                  server_info->hostname,
+                  ERR_NOSUCHCHANNEL,
+                  cli->nick,
+                  chname_safe);
+            continue;
         }
-        // Client is no longer in any channel at this point
+        channel_t* ch_found = find_channel_by_name(server_info, channel_to_join);
+        // Join a channel of which the client is already a member => Do nothing
+        if (ch_found && find_membership(cli, ch_found) >= 0)
+            continue;
         if (!ch_found) // Create the channel if it doesn't exist yet
         {
-            channel_t* new_ch = malloc(sizeof(channel_t));
-            LinkedList* members = malloc(sizeof(LinkedList));
-            init_list(members);
-            new_ch->members = members;
-            strcpy(new_ch->name, channel_to_join);
+            channel_t* new_ch = pool_alloc(&server_info->channel_pool);
+            if (!new_ch)
+                continue;
+            memset(new_ch, 0, sizeof(*new_ch));
+            slice_copy(new_ch->name, MAX_CHANNAME, channel_to_join);
+            casefold(new_ch->key, channel_to_join, MAX_CHANNAME-1);
             // Backward pointer to server's channel list
-            new_ch->node_channels = add_item(server_info->channels, new_ch);
+            add_node(server_info->channels, &new_ch->node_channels);
+            table_insert(&server_info->chan_names, new_ch->key, new_ch);
+            server_info->snapshot_valid = FALSE;
             ch_found = new_ch;
         }
         // Channel to join (ch_found) exists at this point
-        cli->node_members = add_item(ch_found->members, cli); // Backward pointer to channel's member list
-        cli->channel = ch_found;
+        if (add_member(ch_found, cli) < 0)
+        {
+            remove_channel_if_empty(server_info, ch_found);
+            continue;
+        }
         
         // ECHO - JOIN to all members, including the newly joined client
-        echo_message(server_info, cli, TRUE,
-                     ":%s!%s@%s JOIN %s\r\n",
-                     cli->nick,
-                     cli->user,
-                     cli->hostname,
-                     ch_found->name);
+        ReplyBuilder rb;
+        begin_event(&rb, cli);
+        RB_LITERAL(&rb, " JOIN ");
+        rb_str(&rb, ch_found->name);
+        broadcast(server_info, ch_found, NULL, &rb);
         
         // REPLY - Send the list of channel members
-        ITER_LOOP(jt, ch_found->members)
-        {
-            client_t* other = (client_t *) iter_get_item(jt);
-            reply(server_info, cli,
-                  ":%s %d %s = %s :%s\r\n",
-                  server_info->hostname,
-                  RPL_NAMREPLY,
-                  cli->nick,
-                  ch_found->name,
-                  other->nick);
-        } /* Iterator loop */
-        ITER_END(jt);
-        
-        // REPLY - End
-        reply(server_info, cli,
-              ":%s %d %s %s :End of /NAMES list\r\n",
-              server_info->hostname,
-              RPL_ENDOFNAMES,
-              cli->nick,
-              ch_found->name);
-    } /* Channel name valid */
+        reply_names(server_info, cli, SLICE(ch_found->name));
+    }
 }
 
 
@@ -732,10 +2053,8 @@ void cmdJoin(CMD_ARGS)
  */
 void cmdPart(CMD_ARGS)
 {
-    char *to_free, *ch_list;
-    to_free = ch_list = strdup(params[0]);
-    char *ch_name = strtok(ch_list, ",");
-    while (ch_name)
+    slice_t ch_list = params[0], ch_name;
+    while (next_item(&ch_list, &ch_name))
     {
         // Find the channel the client wishes to part
         channel_t* ch_found = find_channel_by_name(server_info, ch_name);
@@ -750,7 +2069,7 @@ void cmdPart(CMD_ARGS)
                   safe_chname);
         }
         // Channel found
-        else if ( !find_item(ch_found->members, cli) ) // ERROR - Not on channel
+        else if (find_membership(cli, ch_found) < 0) // ERROR - Not on channel
         {
             reply(server_info, cli,
                   ":%s %d %s %s :You're not on that channel\r\n",
@@ -761,51 +2080,46 @@ void cmdPart(CMD_ARGS)
         }
         else // Client is indeed in the channel to part
         {
-            // ECHO - QUIT to channel members
-            echo_message(server_info, cli, TRUE,
-                         ":%s!%s@%s QUIT :\r\n", // CHOICE: The joiner also gets back QUIT
-                         cli->nick,
-                         cli->user,
-                         cli->hostname);
+            // ECHO - PART to channel members, including the parter: the
+            // client may stay on other channels, so this cannot be a QUIT
+            ReplyBuilder rb;
+            begin_event(&rb, cli);
+            RB_LITERAL(&rb, " PART ");
+            rb_str(&rb, ch_found->name);
+            broadcast(server_info, ch_found, NULL, &rb);
             
-            remove_client_from_channel(server_info, cli);
-            cli->channel = NULL;
+            // The echo may have made the client quit, and leave all its channels
+            int slot = find_membership(cli, ch_found);
+            if (slot >= 0)
+                remove_client_from_channel(server_info, cli, slot);
         }
-        ch_name = strtok(NULL, ",");
     }
-    free(to_free);
 }
 
 
 /**
  * Command LIST
+ *
+ * Only the start of the listing is sent here; the rest follows as the
+ * client takes it (see |continue_streams()|).
  */
 void cmdList(CMD_ARGS)
 {
-    reply(server_info, cli,
-          ":%s %d %s Channel :Users Name\r\n",
-          server_info->hostname,
-          RPL_LISTSTART,
-          cli->nick);
-    
-    ITER_LOOP(it, server_info->channels)
-    {
-        channel_t* ch = (channel_t *) iter_get_item(it);
-        reply(server_info, cli,
-              ":%s %d %s %s %d :\r\n",
-              server_info->hostname,
-              RPL_LIST,
-              cli->nick,
-              ch->name,
-              ch->members->size);
-    } /* Iterator loop */
-    ITER_END(it);
-    
-    reply(server_info, cli,
-          ":%s %d %s :End of /LIST\r\n",
-          server_info->hostname,
-          RPL_LISTEND,
-          cli->nick);
+    list_state_t* st = calloc(1, sizeof(list_state_t));
+    if (!st)
+        return;
+    st->stream.next_page = list_next_page;
+    st->stream.end = list_end;
+    st->stream.destroy = list_destroy;
+    parse_list_conditions(st, nparams > 0 ? params[0] : (slice_t) { "", 0 });
+    st->snapshot_gen = server_info->snapshot_gen;
+
+    stop_stream(server_info, cli);
+    ReplyBuilder rb;
+    begin_numeric(&rb, server_info, RPL_LISTSTART, cli);
+    RB_LITERAL(&rb, " Channel :Users Name");
+    send_reply(server_info, cli, &rb);
+    start_stream(server_info, cli, &st->stream);
 }
 
 
@@ -839,55 +2153,48 @@ void cmdPmsg(CMD_ARGS)
               cli->nick);
         return;
     }
+    // Each recipient gets the message once, through the first target that
+    // reaches it. All recipients are collected (and stamped) before any is
+    // sent anything: a recipient whose queue overflows quits, and the fan-out
+    // of its QUIT takes a new stamp.
+    struct {
+        OutBuf* buf;     // The message, as sent to this target
+        size_t end;      // End of the target's recipients on the stack
+    } sends[MAX_PMSG_TARGETS];
+    int num_sends = 0;
+    unsigned int stamp = new_stamp(server_info);
+    cli->visit = stamp; // Do nothing if the target is the sending client
+    size_t base = server_info->peers_len;
+
     // Parse target list, delimited by ","
-    char *target_list, *to_free;
-    to_free = target_list = strdup(params[0]);
-    char *target = strtok(target_list, ",");
-    while (target)
-    {
-        if (!strcmp(target, cli->nick))
-        {   // Do nothing if the target is the sending client
-            target = strtok(NULL, ",");
-            continue;
-        }
-        
+    slice_t target_list = params[0], target;
+    while (!cli->zombie && num_sends < MAX_PMSG_TARGETS &&
+           next_item(&target_list, &target))
+    {
+        size_t start = server_info->peers_len;
+        // Only a channel name starts with a sigil, and a nickname cannot
         int target_found = FALSE;
-        
-        // Is the target a client?
-        ITER_LOOP(it, server_info->clients)
+        if (has_channel_sigil(target))
         {
-            client_t* other = (client_t *) iter_get_item(it);
-            if (!strcmp(target, other->nick)) // Target found
+            channel_t* ch_found = find_channel_by_name(server_info, target);
+            if (ch_found && reserve_peers(server_info, ch_found->num_members) == 0)
             {
                 target_found = TRUE;
-                reply(server_info, other,
-                      ":%s PRIVMSG %s :%s\r\n",
-                      cli->nick,
-                      target,
-                      params[1]);
-                break;
+                push_members(server_info, ch_found, stamp);
             }
         }
-        ITER_END(it);
-        
-        // Is the target is a channel?
-        channel_t* ch_found = find_channel_by_name(server_info, target);
-        if (ch_found)
+        else
         {
-            target_found = TRUE;
-            ITER_LOOP(it, ch_found->members)
+            client_t* other = find_client_by_nick(server_info, target);
+            if (other && reserve_peers(server_info, 1) == 0)
             {
-                client_t* other = (client_t *) iter_get_item(it);
-                if (other != cli)
+                target_found = TRUE;
+                if (other->visit != stamp)
                 {
-                    reply(server_info, other,
-                          ":%s PRIVMSG %s :%s\r\n",
-                          cli->nick,
-                          target,
-                          params[1]);
+                    other->visit = stamp;
+                    server_info->peers[server_info->peers_len++] = other;
                 }
             }
-            ITER_END(it);
         }
         
         // Target name matches neither client nor a channel
@@ -895,101 +2202,128 @@ void cmdPmsg(CMD_ARGS)
         if (!target_found)
         {
             reply(server_info, cli,
-                  ":%s %d %s %s :No such nick/channel\r\n",
+                  ":%s %d %s %.*s :No such nick/channel\r\n",
                   server_info->hostname,
                   ERR_NOSUCHNICK,
                   cli->nick,
-                  target);
+                  SLICE_ARG(target));
+            continue;
         }
-        // Go to next target name
-        target = strtok(NULL, ",");
+        if (server_info->peers_len == start)
+            continue; // Everyone was reached through an earlier target
         
+        // The message is the same for every recipient of the target
+        ReplyBuilder rb;
+        rb_reset(&rb);
+        RB_LITERAL(&rb, ":");
+        rb_str(&rb, cli->nick);
+        RB_LITERAL(&rb, " PRIVMSG ");
+        rb_slice(&rb, target);
+        RB_LITERAL(&rb, " :");
+        rb_slice(&rb, params[1]);
+        sends[num_sends].buf = finish_reply(&rb);
+        sends[num_sends].end = server_info->peers_len;
+        num_sends++;
     } /* while(target) */
-    free(to_free);
+
+    // An error reply may have made the sender quit: then the message is
+    // not delivered at all
+    int deliver = !cli->zombie;
+    // The stack may grow (and move) while sending, but not shrink below the end
+    size_t i = base;
+    for (int s = 0; s < num_sends; s++)
+    {
+        for (; deliver && i < sends[s].end; i++)
+            reply_buf(server_info, server_info->peers[i], sends[s].buf);
+        if (sends[s].buf)
+            outbuf_unref(sends[s].buf);
+    }
+    server_info->peers_len = base;
 }
 
 
 /**
  * Command WHO
+ *
+ * Only the start of the reply is sent here; the rest follows as the client
+ * takes it (see |continue_streams()|).
  */
 void cmdWho(CMD_ARGS)
 {
-    // No <name> is given=> Return all visible users
-    // As per RFC:
-    //   In the absence of the <name> parameter, all visible (users who aren't invisible (user mode +i)
-    //   and who don't have a common channel with the requesting client) are listed
-    if (!nparams)
+    who_state_t* st = calloc(1, sizeof(who_state_t));
+    if (!st)
+        return;
+    st->stream.next_page = who_next_page;
+    st->stream.end = who_end;
+    st->stream.destroy = who_destroy;
+    if (nparams)
     {
-        ITER_LOOP(it, server_info->clients)
+        size_t len = slice_copy(st->text, sizeof(st->text), params[0]);
+        st->targets = (slice_t) { st->text, len };
+        slice_t rest = st->targets, first;
+        if (!next_item(&rest, &first))
         {
-            client_t* other = iter_get_item(it);
-            if (!other->registered) continue;
-            if (!cli->channel   || // No common channel if one of them doesn't have a channel
-                !other->channel ||
-                (other->channel != cli->channel))
-            {
-                // RFC: <channel> <user> <host> <server> <nick> <H|G>[*][@|+] :<hopcount> <real name>
-                reply(server_info, cli,
-                      ":%s %d %s %s %s %s %s %s H :0 %s\r\n",
-                      server_info->hostname,
-                      RPL_WHOREPLY,
-                      cli->nick,
-                      *other->channel->name ? other->channel->name: "*",
-                      other->user,
-                      other->hostname,
-                      server_info->hostname,
-                      other->nick,
-                      other->realname
-                      );
-            }
-            reply(server_info, cli,
-                  "%s %d %s * :End of /WHO list\r\n",
-                  server_info->hostname,
-                  RPL_ENDOFWHO,
-                  cli->nick);
+            // No name in it, e.g. "WHO ,": the end for the parameter itself
+            stop_stream(server_info, cli);
+            reply_end_of_who(server_info, cli, len ? st->targets : SLICE("*"));
+            who_destroy(&st->stream);
+            return;
         }
-        ITER_END(it);
     }
     else
     {
-        char *to_free, *target_list;
-        to_free = target_list = strdup(params[0]);
-        char* target = strtok(target_list, ",");
-        while (target)
+        // No <name> is given => Return all visible users
+        // As per RFC:
+        //   In the absence of the <name> parameter, all visible (users who aren't invisible (user mode +i)
+        //   and who don't have a common channel with the requesting client) are listed
+        st->visible = TRUE;
+        st->target = SLICE("*");
+        st->phase = WHO_SCAN;
+        st->stream.client = cli;
+        if (who_hide_peers(server_info, st) < 0)
         {
-            // As per CMPU-375 RFC Note:
-            // Your server should match <name> against channel name only
-            GET_SAFE_NAME(safe_query, target);
-            channel_t* ch_match = find_channel_by_name(server_info, safe_query);
-            if (ch_match)
-            {
-                // Loop through all members of that channel
-                ITER_LOOP(it_cli, ch_match->members)
-                {
-                    client_t* other = (client_t *) iter_get_item(it_cli);
-                    // RFC: <channel> <user> <host> <server> <nick> <H|G>[*][@|+] :<hopcount> <real name>
-                    reply(server_info, cli,
-                          ":%s %d %s %s %s %s %s %s H :0 %s\r\n",
-                          server_info->hostname, RPL_WHOREPLY, cli->nick,
-                          other->channel->name,
-                          other->user,
-                          other->hostname,
-                          server_info->hostname,
-                          other->nick,
-                          other->realname);
-                } /* Iterator loop */
-                ITER_END(it_cli);
-            }
-            // CHOICE: if |safe_query| doesn't match any channel, fall through
-            reply(server_info, cli,
-                  ":%s %d %s %s :End of /WHO list\r\n",
-                  server_info->hostname,
-                  RPL_ENDOFWHO,
-                  cli->nick,
-                  safe_query);
-            
-            target = strtok(NULL, ",");
+            who_destroy(&st->stream);
+            return;
         }
-        free(to_free);
     }
+
+    stop_stream(server_info, cli);
+    start_stream(server_info, cli, &st->stream);
+}
+
+
+/**
+ * Command NAMES
+ */
+void cmdNames(CMD_ARGS)
+{
+    if (nparams)
+    {
+        // CHOICE: an unknown channel only gets the end of the list
+        slice_t ch_list = params[0], ch_name;
+        while (!cli->zombie && next_item(&ch_list, &ch_name))
+            reply_names(server_info, cli, ch_name);
+        return;
+    }
+    
+    // No <channel> is given => List every channel, then the registered
+    // clients that are not on any channel, as if on channel "*". Only the
+    // start of the reply is sent here (see |continue_streams()|), or the
+    // whole of it comes after the channels already queued.
+    names_state_t* st = names_in_progress(cli);
+    if (st)
+    {
+        st->all = TRUE;
+        return;
+    }
+    st = calloc(1, sizeof(names_state_t));
+    if (!st)
+        return;
+    st->stream.next_page = names_next_page;
+    st->stream.end = names_end;
+    st->stream.destroy = names_destroy;
+    st->all = TRUE;
+    st->snapshot_gen = server_info->snapshot_gen;
+    stop_stream(server_info, cli);
+    start_stream(server_info, cli, &st->stream);
 }
@@ -49,6 +49,14 @@ typedef enum {
 } rpl_t;
 
 
-void handle_line(char* line, server_info_t* server_info, client_t* cli);
+void update_source(client_t* cli);
+
+int continue_streams(server_info_t* server_info);
+
+int streams_ready(server_info_t* server_info);
+
+void free_stream(client_t* cli);
+
+void handle_line(const char* line, size_t len, server_info_t* server_info, client_t* cli);
 
 #endif /* _IRC_PROTO_H_ */
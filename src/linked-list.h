@@ -1,82 +1,79 @@
 #ifndef _LINKED_LIST_H_
 #define _LINKED_LIST_H_
 
-/* Node */
+#include <stddef.h>
+
+/* Node, embedded in the item it links */
 struct _node_struct {
     struct _node_struct* prev;
     struct _node_struct* next;
-    void* item;
-    int __id;
-    int __valid;
+    int __linked;
 };
 
 typedef struct _node_struct Node;
 
 
-/* Linked List */
+/**
+ * Linked List.
+ *
+ * An intrusive doubly linked list: each item embeds one |Node| per list it
+ * may be in, so adding and dropping items never allocates.
+ * |LIST_ITEM()| maps a node back to the item that contains it.
+ *
+ * Dropping a node unlinks it at once, but leaves its |next| link alone, so
+ * that an iterator standing on the node (or on a node dropped before it)
+ * still finds its way back into the list. Hence an item dropped from a list
+ * must stay allocated until the end of the current epoch, i.e. the current
+ * event-loop iteration, when no iterator can be left (see |reap_zombies()|);
+ * and a node must not be added back from within a loop over its old list.
+ */
 typedef struct {
     Node* head;
     int size;
-    int __id_gen;
-    int __references;
-    int __has_invalid;
 } LinkedList;
 
 
-void init_list(LinkedList* list);
-
-Node* add_item(LinkedList* list, void* item);
+#define LIST_ITEM(node, type, member) \
+    ((type *) ((char *) (node) - offsetof(type, member)))
 
-Node* find_item(LinkedList* list, void* item);
+void init_list(LinkedList* list);
 
-void* drop_node(LinkedList* list, Node* node);
+void add_node(LinkedList* list, Node* node);
 
-void* find_and_drop_item(LinkedList* list, void* item);
+void drop_node(LinkedList* list, Node* node);
 
-char* list_to_str(LinkedList* list, char* buf);
+int node_linked(Node* node);
 
 
 /**
  * Linked List Iterator.
  *
+ * Iterators live on the stack, and need no cleanup.
+ *
  * Example Usage
- 
-     LinkedList* list;
-     // Adding items to |list| ...
-     Iterator_LinkedList* it;
-     for (it = iter(list); !iter_empty(it); it = iter_next(it))
+
+     ITER_LOOP(it, server_info->clients)
      {
-        // iter_get, iter_add, iter_drop_curr, etc.
+        client_t* cli = ITER_ITEM(it, client_t, node_clients);
+        // drop_node() is allowed here, on any node
      }
-     iter_clean(it);
- 
+
 */
 
 typedef struct {
-    LinkedList* list;
     Node* curr;
 } Iterator_LinkedList;
 
-Iterator_LinkedList* iter(LinkedList* list);
-
-void iter_clean(Iterator_LinkedList* it);
+Iterator_LinkedList iter(LinkedList* list);
 
 int iter_empty(Iterator_LinkedList* it);
 
 void iter_next(Iterator_LinkedList* it);
 
-void* iter_get_item(Iterator_LinkedList* it);
-
-Node* iter_get_node(Iterator_LinkedList* it);
-
-void* iter_drop_curr(Iterator_LinkedList* it);
-
 #define ITER_LOOP(it, list) \
-    Iterator_LinkedList* it; \
-    for (it = iter(list); !iter_empty(it); iter_next(it))
+    for (Iterator_LinkedList it = iter(list); !iter_empty(&it); iter_next(&it))
 
-#define ITER_END(it) do { iter_clean(it); } while (0)
+#define ITER_ITEM(it, type, member) LIST_ITEM((it).curr, type, member)
 
 
 #endif /* _LINKED_LIST_H_ */
-
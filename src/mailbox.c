@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "mailbox.h"
+#include "debug.h"
+
+
+/**
+ * Initialize a mailbox.
+ * This function must be called once and only once before a mailbox
+ * may be used.
+ */
+int init_mailbox(Mailbox* mb)
+{
+    mb->stub.next = NULL;
+    mb->head = &mb->stub;
+    mb->tail = &mb->stub;
+    mb->signaled = 0;
+    mb->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mb->wakefd < 0 ? -1 : 0;
+}
+
+
+/**
+ * Allocate a message, carrying a copy of |len| bytes from |data| (if any).
+ * The copy is always NUL-terminated. Returns NULL if out of memory.
+ */
+Message* new_message(int type, void* item, const char* data, size_t len)
+{
+    Message* msg = malloc(sizeof(Message) + len + 1);
+    if (!msg)
+    {
+        DEBUG_PERROR("Cannot allocate message");
+        return NULL;
+    }
+    msg->next = NULL;
+    msg->type = type;
+    msg->item = item;
+    msg->len = len;
+    if (data)
+        memcpy(msg->data, data, len);
+    msg->data[len] = '\0';
+    return msg;
+}
+
+
+/**
+ * Enqueue a message (any thread).
+ */
+static void push(Mailbox* mb, Message* msg)
+{
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    Message* prev = __atomic_exchange_n(&mb->head, msg, __ATOMIC_ACQ_REL);
+    // Between these two steps, the consumer cannot see past |prev|
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Post a message to a mailbox (any thread), and wake the owner up
+ * unless it has already been woken up and not yet acknowledged.
+ */
+void mailbox_post(Mailbox* mb, Message* msg)
+{
+    push(mb, msg);
+    mailbox_wake(mb);
+}
+
+
+/**
+ * Wake the owner up (any thread), even with no message to take, unless
+ * it has already been woken up and not yet acknowledged.
+ */
+void mailbox_wake(Mailbox* mb)
+{
+    if (!__atomic_exchange_n(&mb->signaled, 1, __ATOMIC_ACQ_REL))
+    {
+        uint64_t one = 1;
+        if (write(mb->wakefd, &one, sizeof(one)) < 0)
+        {
+            // The counter cannot overflow: the owner is already awake
+        }
+    }
+}
+
+
+/**
+ * Acknowledge a wakeup (owner only).
+ * Must be called before taking the messages out, so that a message posted
+ * while the owner is busy triggers another wakeup.
+ */
+void mailbox_ack(Mailbox* mb)
+{
+    uint64_t count;
+    if (read(mb->wakefd, &count, sizeof(count)) < 0)
+    {
+        // Spurious wakeup
+    }
+    // Read-modify-write, so that everything posted by the producers that
+    // found the mailbox already signaled is visible from now on
+    __atomic_exchange_n(&mb->signaled, 0, __ATOMIC_ACQ_REL);
+}
+
+
+/**
+ * Take the oldest message out of a mailbox (owner only).
+ * Returns NULL if the mailbox is empty, or if a producer is in the middle
+ * of posting (in which case that producer wakes the owner up again).
+ */
+Message* mailbox_take(Mailbox* mb)
+{
+    Message* tail = mb->tail;
+    Message* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &mb->stub)
+    {
+        if (!next)
+            return NULL;
+        mb->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next)
+    {
+        mb->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    // |tail| is the last message: put the stub back behind it
+    push(mb, &mb->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef _MAILBOX_H_
+#define _MAILBOX_H_
+
+#include <stddef.h>
+
+/* Message */
+struct _message_struct {
+    struct _message_struct* next;
+    int type;
+    void* item;
+    size_t len;
+    char data[];
+};
+
+typedef struct _message_struct Message;
+
+
+/**
+ * Mailbox.
+ *
+ * A lock-free multi-producer single-consumer queue of messages: any thread
+ * may post, and only the thread owning the mailbox takes messages out.
+ * The owner is woken up through |wakefd| (an eventfd), which is only
+ * written to when the owner may be asleep.
+ *
+ * Example Usage (owner)
+
+     // |wakefd| reported readable
+     mailbox_ack(mb);
+     Message* msg;
+     while ((msg = mailbox_take(mb)) != NULL)
+     {
+        // Handle |msg| ...
+        free(msg);
+     }
+
+*/
+typedef struct {
+    Message* head;   // Most recently posted message (producers)
+    Message* tail;   // Next message to take (consumer)
+    Message stub;
+    int signaled;
+    int wakefd;
+} Mailbox;
+
+
+int init_mailbox(Mailbox* mb);
+
+Message* new_message(int type, void* item, const char* data, size_t len);
+
+void mailbox_post(Mailbox* mb, Message* msg);
+
+void mailbox_wake(Mailbox* mb);
+
+void mailbox_ack(Mailbox* mb);
+
+Message* mailbox_take(Mailbox* mb);
+
+#endif /* _MAILBOX_H_ */
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+#include "debug.h"
+
+
+/**
+ * Allocate a buffer for |len| bytes, to be filled in by the caller before
+ * it is queued, with a single reference (the caller's).
+ */
+OutBuf* alloc_outbuf(size_t len)
+{
+    OutBuf* buf = (OutBuf *) malloc(sizeof(OutBuf) + len + 1);
+    if (!buf)
+        return NULL;
+    buf->refs = 1;
+    buf->len = len;
+    buf->data[len] = '\0';
+    return buf;
+}
+
+
+/**
+ * Allocate a buffer holding a copy of |len| bytes from |data|, with a
+ * single reference (the caller's).
+ */
+OutBuf* new_outbuf(const char* data, size_t len)
+{
+    OutBuf* buf = alloc_outbuf(len);
+    if (buf)
+        memcpy(buf->data, data, len);
+    return buf;
+}
+
+
+void outbuf_ref(OutBuf* buf)
+{
+    buf->refs++;
+}
+
+
+/**
+ * Drop a reference to a buffer, and free it if that was the last one.
+ */
+void outbuf_unref(OutBuf* buf)
+{
+    if (--buf->refs == 0)
+        free(buf);
+}
+
+
+/**
+ * Initialize an empty output queue.
+ */
+void init_outq(OutQueue* q)
+{
+    q->head = q->tail = NULL;
+    q->head_off = 0;
+    q->bytes = 0;
+}
+
+
+/**
+ * Append a reference to |buf| to the queue.
+ * Returns -1 if out of memory.
+ */
+int outq_push(OutQueue* q, OutBuf* buf)
+{
+    OutChunk* chunk = q->tail;
+    if (!chunk || chunk->end == OUTQ_CHUNK_BUFS)
+    {
+        chunk = (OutChunk *) malloc(sizeof(OutChunk));
+        if (!chunk)
+            return -1;
+        chunk->next = NULL;
+        chunk->start = chunk->end = 0;
+        if (q->tail)
+            q->tail->next = chunk;
+        else
+            q->head = chunk;
+        q->tail = chunk;
+    }
+    outbuf_ref(buf);
+    chunk->bufs[chunk->end++] = buf;
+    q->bytes += buf->len;
+    return 0;
+}
+
+
+/**
+ * Describe up to |max| bytes from the front of the queue with at most
+ * |max_iov| entries of |iov|, without taking them out. A reference to each
+ * buffer is stored in |bufs|, so that they stay valid even if the queue is
+ * cleared; the caller drops them once it is done. Returns the number of
+ * entries used.
+ */
+int outq_pin(OutQueue* q, struct iovec* iov, OutBuf** bufs, int max_iov, size_t max)
+{
+    int n = 0;
+    size_t pinned = 0;
+    size_t off = q->head_off;
+    for (OutChunk* chunk = q->head; chunk && n < max_iov && pinned < max; chunk = chunk->next)
+    {
+        for (int i = chunk->start; i < chunk->end && n < max_iov && pinned < max; i++)
+        {
+            OutBuf* buf = chunk->bufs[i];
+            outbuf_ref(buf);
+            bufs[n] = buf;
+            iov[n].iov_base = buf->data + off;
+            iov[n].iov_len = MIN(buf->len - off, max - pinned);
+            pinned += iov[n].iov_len;
+            n++;
+            off = 0;
+        }
+    }
+    return n;
+}
+
+
+/**
+ * Take |len| bytes (that have been sent) out of the front of the queue.
+ */
+void outq_consume(OutQueue* q, size_t len)
+{
+    q->bytes -= len;
+    while (len > 0)
+    {
+        OutChunk* chunk = q->head;
+        OutBuf* buf = chunk->bufs[chunk->start];
+        size_t left = buf->len - q->head_off;
+        if (len < left)
+        {
+            q->head_off += len;
+            return;
+        }
+        len -= left;
+        q->head_off = 0;
+        outbuf_unref(buf);
+        if (++chunk->start == chunk->end)
+        {
+            q->head = chunk->next;
+            if (!q->head)
+                q->tail = NULL;
+            free(chunk);
+        }
+    }
+}
+
+
+/**
+ * Write as much of the queue as possible to the non-blocking socket |fd|.
+ * Returns 1 if the queue has been emptied, 0 if the socket is full, or
+ * -1 on error.
+ */
+int outq_write(OutQueue* q, int fd)
+{
+    while (q->bytes > 0)
+    {
+        struct iovec iov[OUTQ_MAX_IOV];
+        int iovcnt = 0;
+        size_t off = q->head_off;
+        for (OutChunk* chunk = q->head; chunk && iovcnt < OUTQ_MAX_IOV; chunk = chunk->next)
+        {
+            for (int i = chunk->start; i < chunk->end && iovcnt < OUTQ_MAX_IOV; i++)
+            {
+                iov[iovcnt].iov_base = chunk->bufs[i]->data + off;
+                iov[iovcnt].iov_len = chunk->bufs[i]->len - off;
+                iovcnt++;
+                off = 0;
+            }
+        }
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        outq_consume(q, written);
+    }
+    return 1;
+}
+
+
+/**
+ * Drop everything queued.
+ */
+void outq_clear(OutQueue* q)
+{
+    OutChunk* chunk = q->head;
+    while (chunk)
+    {
+        OutChunk* next = chunk->next;
+        for (int i = chunk->start; i < chunk->end; i++)
+            outbuf_unref(chunk->bufs[i]);
+        free(chunk);
+        chunk = next;
+    }
+    init_outq(q);
+}
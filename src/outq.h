@@ -0,0 +1,89 @@
+#ifndef _OUTQ_H_
+#define _OUTQ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define OUTQ_CHUNK_BUFS 64
+#define OUTQ_MAX_IOV 256
+
+/**
+ * Output Buffer.
+ *
+ * An immutable, reference-counted line of output. A message sent to many
+ * clients is formatted once into a single buffer, and every recipient's
+ * queue holds a reference to it.
+ * Buffers are only ever touched by the core loop, so the reference count
+ * is not atomic.
+ */
+struct _outbuf_struct {
+    int refs;
+    size_t len;
+    char data[];    // Always NUL-terminated
+};
+
+typedef struct _outbuf_struct OutBuf;
+
+
+/* Chunk of references to queued buffers */
+struct _outchunk_struct {
+    struct _outchunk_struct* next;
+    int start;      // First buffer not completely sent
+    int end;        // End of the buffers
+    OutBuf* bufs[OUTQ_CHUNK_BUFS];
+};
+
+typedef struct _outchunk_struct OutChunk;
+
+
+/**
+ * Output Queue.
+ *
+ * The output of a client that has not been sent yet: a chain of chunks
+ * of references to buffers. Buffers are appended whole, and are taken out
+ * from the front as the socket accepts them, possibly in part.
+ *
+ * Example Usage
+
+     OutBuf* buf = new_outbuf(line, len);
+     OutQueue q;
+     init_outq(&q);
+     outq_push(&q, buf);   // Takes its own reference
+     outbuf_unref(buf);
+     if (outq_write(&q, sock) == 0)
+     {
+        // Socket full: call outq_write() again once it is writable
+     }
+     outq_clear(&q);
+
+*/
+typedef struct {
+    OutChunk* head;
+    OutChunk* tail;
+    size_t head_off;  // Bytes of the first buffer already sent
+    size_t bytes;     // Queued and not yet sent
+} OutQueue;
+
+
+OutBuf* alloc_outbuf(size_t len);
+
+OutBuf* new_outbuf(const char* data, size_t len);
+
+void outbuf_ref(OutBuf* buf);
+
+void outbuf_unref(OutBuf* buf);
+
+void init_outq(OutQueue* q);
+
+int outq_push(OutQueue* q, OutBuf* buf);
+
+int outq_pin(OutQueue* q, struct iovec* iov, OutBuf** bufs, int max_iov, size_t max);
+
+void outq_consume(OutQueue* q, size_t len);
+
+int outq_write(OutQueue* q, int fd);
+
+void outq_clear(OutQueue* q);
+
+#endif /* _OUTQ_H_ */
@@ -0,0 +1,170 @@
+#include <string.h>
+
+#include "parse.h"
+#include "debug.h"
+
+
+#define L   (CC_LETTER)
+#define D   (CC_DIGIT)
+#define S   (CC_SPECIAL)
+#define C   (CC_CHSTRING)
+
+/* Classes of all 8-bit codes (see parse.h). '|' counts as a special too. */
+const unsigned char char_class[256] = {
+    [0x01 ... 0xff] = C,
+    [' '] = 0, ['\a'] = 0, ['\r'] = 0, ['\n'] = 0, [','] = 0,
+    ['A' ... 'Z'] = L|C,
+    ['a' ... 'z'] = L|C,
+    ['0' ... '9'] = D|C,
+    ['-'] = S|C, ['['] = S|C, [']'] = S|C, ['\\'] = S|C, ['`'] = S|C,
+    ['^'] = S|C, ['{'] = S|C, ['}'] = S|C, ['|'] = S|C,
+};
+
+#undef L
+#undef D
+#undef S
+#undef C
+
+
+/**
+ * Parse the message of |len| bytes at |line| (without its delimiter) in a
+ * single pass. Returns -1 if it has no command.
+ */
+int parse_message(irc_msg_t* msg, const char* line, size_t len)
+{
+    const char* p = line;
+    const char* end = line + len;
+    msg->prefix.ptr = NULL;
+    msg->trailing.ptr = NULL;
+    msg->nparams = 0;
+
+    if (p < end && *p == ':')
+    {
+        const char* start = ++p;
+        while (p < end && *p != ' ')
+            p++;
+        if (p == end)
+            return -1;
+        msg->prefix = (slice_t) { start, p - start };
+    }
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end)
+        return -1;
+    const char* start = p;
+    while (p < end && *p != ' ')
+        p++;
+    msg->command = (slice_t) { start, p - start };
+
+    while (msg->nparams < MAX_MSG_TOKENS)
+    {
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end)
+            break;
+        if (*p == ':')
+        {
+            // The trailing parameter takes the rest of the message
+            p++;
+            msg->trailing = (slice_t) { p, end - p };
+            msg->params[msg->nparams++] = msg->trailing;
+            break;
+        }
+        start = p;
+        while (p < end && *p != ' ')
+            p++;
+        msg->params[msg->nparams++] = (slice_t) { start, p - start };
+    }
+    return 0;
+}
+
+
+/**
+ * Take the first item off a comma-separated |list|, skipping empty items.
+ * Returns FALSE once the list is exhausted.
+ *
+ * Example Usage
+
+     slice_t list = params[0], target;
+     while (next_item(&list, &target))
+     {
+         // ...
+     }
+
+ */
+int next_item(slice_t* list, slice_t* item)
+{
+    const char* p = list->ptr;
+    const char* end = list->ptr + list->len;
+    while (p < end && *p == ',')
+        p++;
+    if (p == end)
+        return FALSE;
+    const char* comma = memchr(p, ',', end - p);
+    if (!comma)
+        comma = end;
+    *item = (slice_t) { p, comma - p };
+    list->ptr = comma;
+    list->len = end - comma;
+    return TRUE;
+}
+
+
+/**
+ * Check if a slice holds exactly the string |str|.
+ */
+int slice_equals(slice_t s, const char* str)
+{
+    return strlen(str) == s.len && memcmp(s.ptr, str, s.len) == 0;
+}
+
+
+/**
+ * Copy a slice into |dst|, of |size| bytes, as a NUL-terminated string,
+ * truncated if need be. Returns the length copied.
+ */
+size_t slice_copy(char* dst, size_t size, slice_t s)
+{
+    size_t len = s.len < size ? s.len : size - 1;
+    memcpy(dst, s.ptr, len);
+    dst[len] = '\0';
+    return len;
+}
+
+
+/**
+ * Check if the string |str| matches the mask |mask|, in which '*' stands
+ * for any run of characters and '?' for any one character. Both are
+ * compared byte for byte, so fold them first to ignore case.
+ */
+int glob_match(slice_t mask, const char* str)
+{
+    const char* m = mask.ptr;
+    const char* end = mask.ptr + mask.len;
+    const char* star = NULL;    // Last '*' seen in the mask...
+    const char* resume = NULL;  // ... and where its run ends so far
+    while (*str)
+    {
+        if (m < end && *m == '*')
+        {
+            star = ++m;
+            resume = str;
+        }
+        else if (m < end && (*m == '?' || *m == *str))
+        {
+            m++;
+            str++;
+        }
+        else if (star)
+        {
+            // Let the last '*' take one more character, and try again
+            m = star;
+            str = ++resume;
+        }
+        else
+            return FALSE;
+    }
+    while (m < end && *m == '*')
+        m++;
+    return m == end;
+}
@@ -0,0 +1,69 @@
+#ifndef _PARSE_H_
+#define _PARSE_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#define MAX_MSG_TOKENS 10
+
+/* Slice of a message: |len| bytes at |ptr|, not NUL-terminated */
+typedef struct {
+    const char* ptr;
+    size_t len;
+} slice_t;
+
+/* For printing slices, as in printf("%.*s", SLICE_ARG(s)) */
+#define SLICE_ARG(s) (int) (s).len, (s).ptr
+
+/* Slice of a NUL-terminated string */
+#define SLICE(str) ((slice_t) { (str), strlen(str) })
+
+
+/**
+ * Parsed message.
+ *
+ * <message>  ::= [':' <prefix> <SPACE> ] <command> <params> <crlf>
+ * <params>   ::= <SPACE> [ ':' <trailing> | <middle> <params> ]
+ *
+ * All slices point into the message, which is left untouched. The
+ * trailing parameter (if any) is also the last of |params|; |trailing.ptr|
+ * is NULL if there is none, and so is |prefix.ptr|. Parameters beyond
+ * |MAX_MSG_TOKENS| are ignored.
+ */
+typedef struct {
+    slice_t prefix;
+    slice_t command;
+    slice_t params[MAX_MSG_TOKENS];
+    int nparams;
+    slice_t trailing;
+} irc_msg_t;
+
+int parse_message(irc_msg_t* msg, const char* line, size_t len);
+
+int next_item(slice_t* list, slice_t* item);
+
+int slice_equals(slice_t s, const char* str);
+
+size_t slice_copy(char* dst, size_t size, slice_t s);
+
+int glob_match(slice_t mask, const char* str);
+
+
+/**
+ * Character classes.
+ *
+ * <letter>    ::= 'a' ... 'z' | 'A' ... 'Z'
+ * <number>    ::= '0' ... '9'
+ * <special>   ::= '-' | '[' | ']' | '\' | '`' | '^' | '{' | '}'
+ * <chstring>  ::= <any 8bit code except SPACE, BELL, NUL, CR, LF and comma (',')>
+ */
+#define CC_LETTER   0x01
+#define CC_DIGIT    0x02
+#define CC_SPECIAL  0x04
+#define CC_CHSTRING 0x08
+
+extern const unsigned char char_class[256];
+
+#define CHAR_IS(c, classes) (char_class[(unsigned char) (c)] & (classes))
+
+#endif /* _PARSE_H_ */
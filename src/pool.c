@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "debug.h"
+
+
+/**
+ * Initialize an empty pool of objects of |obj_size| bytes, allocated
+ * |per_slab| at a time.
+ */
+void init_pool(Pool* pool, const char* name, size_t obj_size, int per_slab)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+    pool->per_slab = per_slab > 0 ? per_slab : 1;
+}
+
+
+// The statistics are only written by the pool's owner, but may be read
+// by another thread (see |report_pool_stats()|)
+#define SET_STAT(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define GET_STAT(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+
+/**
+ * Add a slab to the pool, and its objects to the free list.
+ * The first cache line of a slab links it to the previous one.
+ */
+static int add_slab(Pool* pool)
+{
+    char* slab = aligned_alloc(POOL_ALIGN, POOL_ALIGN + pool->per_slab * pool->obj_size);
+    if (!slab)
+        return -1;
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    // Push in reverse, so that objects are handed out in address order
+    for (int i = pool->per_slab - 1; i >= 0; i--)
+    {
+        void* obj = slab + POOL_ALIGN + i * pool->obj_size;
+        *(void **) obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    SET_STAT(pool->capacity, pool->capacity + pool->per_slab);
+    return 0;
+}
+
+
+/**
+ * Make sure that the pool holds at least |count| objects, e.g. to
+ * preallocate them at startup.
+ */
+int pool_reserve(Pool* pool, size_t count)
+{
+    int rc = 0;
+    while (pool->capacity < count && rc == 0)
+        rc = add_slab(pool);
+    return rc;
+}
+
+
+/**
+ * Allocate an object (not initialized), or return NULL if out of memory.
+ */
+void* pool_alloc(Pool* pool)
+{
+    if (!pool->free_list && add_slab(pool) < 0)
+        return NULL;
+    void* obj = pool->free_list;
+    pool->free_list = *(void **) obj;
+    SET_STAT(pool->in_use, pool->in_use + 1);
+    SET_STAT(pool->allocs, pool->allocs + 1);
+    if (pool->in_use > pool->peak)
+        SET_STAT(pool->peak, pool->in_use);
+    return obj;
+}
+
+
+/**
+ * Return an object to its pool.
+ */
+void pool_free(Pool* pool, void* obj)
+{
+    *(void **) obj = pool->free_list;
+    pool->free_list = obj;
+    SET_STAT(pool->in_use, pool->in_use - 1);
+}
+
+
+/**
+ * Print the occupancy of a pool (from any thread).
+ */
+void report_pool_stats(Pool* pool)
+{
+    eprintf("[pool %s] in_use=%zu peak=%zu capacity=%zu allocs=%lu slab=%d x %zu bytes\n",
+            pool->name,
+            GET_STAT(pool->in_use),
+            GET_STAT(pool->peak),
+            GET_STAT(pool->capacity),
+            GET_STAT(pool->allocs),
+            pool->per_slab,
+            pool->obj_size);
+}
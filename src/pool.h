@@ -0,0 +1,55 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+#define POOL_ALIGN 64      // Objects start on a cache line
+
+
+/**
+ * Object Pool.
+ *
+ * A slab allocator for objects of a single size: objects are carved out of
+ * large slabs, and freed objects go onto a free list, from which they are
+ * handed out again most recently freed first, while they are still warm in
+ * the cache. Slabs are never given back, so a pool only grows to the peak
+ * number of objects; it does not fragment the heap under churn.
+ *
+ * A pool belongs to a single thread, and takes no lock: each event loop
+ * has its own pools of clients (see |io_loop_t|). Only its statistics may
+ * be read from another thread.
+ *
+ * Example Usage
+
+     Pool pool;
+     init_pool(&pool, "client", sizeof(client_t), 64);
+     pool_reserve(&pool, 1024);   // Optional
+     client_t* cli = pool_alloc(&pool);
+     pool_free(&pool, cli);
+
+*/
+typedef struct {
+    const char* name;
+    size_t obj_size;        // Rounded up to |POOL_ALIGN|
+    int per_slab;           // Objects carved out of each slab
+    void* free_list;        // Linked through the first word of each object
+    void* slabs;            // Linked through the first word of each slab
+    // Statistics
+    size_t capacity;        // Objects in all slabs
+    size_t in_use;
+    size_t peak;
+    unsigned long allocs;
+} Pool;
+
+
+void init_pool(Pool* pool, const char* name, size_t obj_size, int per_slab);
+
+int pool_reserve(Pool* pool, size_t count);
+
+void* pool_alloc(Pool* pool);
+
+void pool_free(Pool* pool, void* obj);
+
+void report_pool_stats(Pool* pool);
+
+#endif /* _POOL_H_ */
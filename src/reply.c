@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "reply.h"
+
+
+/**
+ * Append |len| bytes, or as many as fit.
+ */
+void rb_append(ReplyBuilder* rb, const char* data, size_t len)
+{
+    size_t room = RB_MAX_LEN - 2 - rb->len;
+    if (len > room)
+        len = room;
+    memcpy(rb->data + rb->len, data, len);
+    rb->len += len;
+}
+
+
+void rb_str(ReplyBuilder* rb, const char* str)
+{
+    rb_append(rb, str, strlen(str));
+}
+
+
+void rb_slice(ReplyBuilder* rb, slice_t s)
+{
+    rb_append(rb, s.ptr, s.len);
+}
+
+
+/**
+ * Append a number in decimal.
+ */
+void rb_int(ReplyBuilder* rb, int n)
+{
+    char digits[12];
+    char* p = digits + sizeof(digits);
+    unsigned int u = n < 0 ? -(unsigned int) n : (unsigned int) n;
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (n < 0)
+        *--p = '-';
+    rb_append(rb, p, digits + sizeof(digits) - p);
+}
+
+
+/**
+ * Append a numeric reply code, which is always three digits.
+ */
+void rb_numeric(ReplyBuilder* rb, int numeric)
+{
+    char code[3] = {
+        '0' + numeric / 100 % 10,
+        '0' + numeric / 10 % 10,
+        '0' + numeric % 10,
+    };
+    rb_append(rb, code, 3);
+}
+
+
+/**
+ * End the line with "\r\n" (and a NUL), and return its length.
+ */
+size_t rb_finish(ReplyBuilder* rb)
+{
+    memcpy(rb->data + rb->len, "\r\n", 3);
+    rb->len += 2;
+    return rb->len;
+}
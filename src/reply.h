@@ -0,0 +1,63 @@
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include "parse.h"
+
+#define RB_MAX_LEN 512  // As RFC_MAX_MSG_LEN, "\r\n" included
+
+
+/**
+ * Reply Builder.
+ *
+ * Builds a line of output by appending its pieces, without going through
+ * printf(): literal segments, strings and slices are copied as they are,
+ * and numbers are rendered by hand. Pieces that would make the line longer
+ * than |RB_MAX_LEN| are truncated, so that there is always room left for
+ * the final "\r\n".
+ *
+ * Example Usage
+
+     ReplyBuilder rb;
+     rb_reset(&rb);
+     rb_append(&rb, server_info->prefix, server_info->prefix_len);
+     rb_numeric(&rb, RPL_LIST);
+     RB_LITERAL(&rb, " ");
+     rb_str(&rb, cli->nick);
+     size_t len = rb_finish(&rb);   // |rb.data| is NUL-terminated
+
+*/
+typedef struct {
+    size_t len;
+    char data[RB_MAX_LEN + 1];
+} ReplyBuilder;
+
+
+#define RB_LITERAL(rb, str) rb_append((rb), (str), sizeof(str) - 1)
+
+static inline void rb_reset(ReplyBuilder* rb)
+{
+    rb->len = 0;
+}
+
+/* Go back to the first |len| bytes, e.g. to reuse the start of a line */
+static inline void rb_rewind(ReplyBuilder* rb, size_t len)
+{
+    rb->len = len;
+}
+
+void rb_append(ReplyBuilder* rb, const char* data, size_t len);
+
+void rb_str(ReplyBuilder* rb, const char* str);
+
+void rb_slice(ReplyBuilder* rb, slice_t s);
+
+void rb_int(ReplyBuilder* rb, int n);
+
+void rb_numeric(ReplyBuilder* rb, int numeric);
+
+size_t rb_finish(ReplyBuilder* rb);
+
+#endif /* _REPLY_H_ */
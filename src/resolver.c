@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "io-engine.h"
+#include "irc-proto.h"
+#include "debug.h"
+
+#define CACHE_BUCKETS (2 * RESOLVER_CACHE_SIZE) // Power of 2
+
+/* Cache entry for one address */
+typedef struct {
+    in_addr_t addr;
+    int pending;                  // Lookup in progress
+    client_handle_t* waiting;     // Clients waiting for the lookup
+    int num_waiting;
+    int max_waiting;
+    time_t expires;
+    int lru_prev, lru_next;       // Most recently used first
+    int hash_next;
+    char hostname[MAX_HOSTNAME];  // Empty if the address has no name
+} cache_entry_t;
+
+/* Lookup, handed to the resolver threads and back */
+typedef struct job {
+    struct job* next;
+    int slot;                     // Cache entry waiting for the result
+    Message* done;                // MSG_RESOLVED, allocated up front
+    struct sockaddr_in addr;
+    char hostname[MAX_HOSTNAME];
+} job_t;
+
+struct resolver {
+    server_info_t* server_info;
+    // Pending lookups (shared with the resolver threads)
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    job_t* jobs_head;
+    job_t* jobs_tail;
+    // Cache (core loop only)
+    cache_entry_t entries[RESOLVER_CACHE_SIZE];
+    int num_entries;
+    int buckets[CACHE_BUCKETS];
+    int lru_head, lru_tail;
+};
+
+
+static time_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+static int bucket_of(in_addr_t addr)
+{
+    return (int) (((uint32_t) addr * 2654435761u) & (CACHE_BUCKETS - 1));
+}
+
+
+static int cache_find(resolver_t* r, in_addr_t addr)
+{
+    int slot = r->buckets[bucket_of(addr)];
+    while (slot >= 0 && r->entries[slot].addr != addr)
+        slot = r->entries[slot].hash_next;
+    return slot;
+}
+
+
+static void lru_unlink(resolver_t* r, int slot)
+{
+    cache_entry_t* e = &r->entries[slot];
+    if (e->lru_prev >= 0)
+        r->entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        r->lru_head = e->lru_next;
+    if (e->lru_next >= 0)
+        r->entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        r->lru_tail = e->lru_prev;
+}
+
+
+static void lru_push_front(resolver_t* r, int slot)
+{
+    cache_entry_t* e = &r->entries[slot];
+    e->lru_prev = -1;
+    e->lru_next = r->lru_head;
+    if (r->lru_head >= 0)
+        r->entries[r->lru_head].lru_prev = slot;
+    else
+        r->lru_tail = slot;
+    r->lru_head = slot;
+}
+
+
+static void hash_unlink(resolver_t* r, int slot)
+{
+    int* link = &r->buckets[bucket_of(r->entries[slot].addr)];
+    while (*link != slot)
+        link = &r->entries[*link].hash_next;
+    *link = r->entries[slot].hash_next;
+}
+
+
+/* Make room for a new entry, evicting the least recently used entry
+ * whose lookup is complete if the cache is full.
+ * Returns -1 if every entry is still waiting for its lookup.
+ */
+static int cache_alloc(resolver_t* r)
+{
+    if (r->num_entries < RESOLVER_CACHE_SIZE)
+        return r->num_entries++;
+    int slot = r->lru_tail;
+    while (slot >= 0 && r->entries[slot].pending)
+        slot = r->entries[slot].lru_prev;
+    if (slot < 0)
+        return -1;
+    lru_unlink(r, slot);
+    hash_unlink(r, slot);
+    return slot;
+}
+
+
+/* Body of a resolver thread.
+ */
+static void* run_resolver(void* arg)
+{
+    resolver_t* r = (resolver_t *) arg;
+    while (TRUE)
+    {
+        pthread_mutex_lock(&r->lock);
+        while (!r->jobs_head)
+            pthread_cond_wait(&r->cond, &r->lock);
+        job_t* job = r->jobs_head;
+        r->jobs_head = job->next;
+        if (!r->jobs_head)
+            r->jobs_tail = NULL;
+        pthread_mutex_unlock(&r->lock);
+
+        char host_buf[NI_MAXHOST];
+        if (getnameinfo((struct sockaddr *) &job->addr, sizeof(job->addr),
+                        host_buf, sizeof(host_buf), NULL, 0, NI_NAMEREQD))
+            host_buf[0] = '\0';
+        strncpy(job->hostname, host_buf, MAX_HOSTNAME-1);
+        job->hostname[MAX_HOSTNAME-1] = '\0';
+
+        mailbox_post(&r->server_info->loop->mailbox, job->done);
+    }
+    return NULL;
+}
+
+
+/* Start |num_threads| resolver threads.
+ */
+resolver_t* start_resolver(server_info_t* server_info, int num_threads)
+{
+    resolver_t* r = (resolver_t *) malloc(sizeof(resolver_t));
+    memset(r, 0, sizeof(*r));
+    r->server_info = server_info;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    memset(r->buckets, -1, sizeof(r->buckets));
+    r->lru_head = r->lru_tail = -1;
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_t thread;
+        int __rc = pthread_create(&thread, NULL, run_resolver, r);
+        if (__rc)
+        {
+            errno = __rc;
+            return NULL;
+        }
+        pthread_detach(thread);
+    }
+    return r;
+}
+
+
+/* Look up the client's hostname, from the cache if possible.
+ * The client keeps its numeric address as its hostname until the lookup
+ * completes, or for good if the address has no name.
+ */
+void resolve_client(server_info_t* server_info, client_t* cli)
+{
+    resolver_t* r = server_info->resolver;
+    in_addr_t addr = cli->cold->cliaddr.sin_addr.s_addr;
+    int slot = cache_find(r, addr);
+    cache_entry_t* e = slot >= 0 ? &r->entries[slot] : NULL;
+
+    if (e && !e->pending && e->expires > now())
+    {
+        DEBUG_PRINTF(DEBUG_CLIENTS, "Hostname of %s cached: %s\n",
+                     cli->cold->hostname, e->hostname[0] ? e->hostname : "(none)");
+        if (e->hostname[0])
+        {
+            strcpy(cli->cold->hostname, e->hostname);
+            update_source(cli);
+        }
+        lru_unlink(r, slot);
+        lru_push_front(r, slot);
+        return;
+    }
+
+    if (!e)
+    {
+        slot = cache_alloc(r);
+        if (slot < 0)
+            return; // Too many lookups in progress: go without
+        e = &r->entries[slot];
+        e->addr = addr;
+        e->hash_next = r->buckets[bucket_of(addr)];
+        r->buckets[bucket_of(addr)] = slot;
+    }
+    else
+    {
+        lru_unlink(r, slot);
+    }
+    lru_push_front(r, slot);
+
+    // Wait for the lookup in progress, if any
+    if (e->num_waiting == e->max_waiting)
+    {
+        int new_max = e->max_waiting ? 2 * e->max_waiting : 4;
+        client_handle_t* waiting = realloc(e->waiting, new_max * sizeof(client_handle_t));
+        if (!waiting)
+            return; // Go without
+        e->waiting = waiting;
+        e->max_waiting = new_max;
+    }
+    e->waiting[e->num_waiting++] = cli->handle;
+    if (e->pending)
+        return;
+
+    job_t* job = (job_t *) malloc(sizeof(job_t));
+    Message* done = job ? new_message(MSG_RESOLVED, job, NULL, 0) : NULL;
+    if (!done)
+    {
+        DEBUG_PRINTF(DEBUG_ERRS, "Out of memory: hostname of %s not looked up\n",
+                     cli->cold->hostname);
+        free(job);
+        e->num_waiting--;
+        return; // Go without
+    }
+    e->pending = TRUE;
+    job->done = done;
+    job->next = NULL;
+    job->slot = slot;
+    memcpy(&job->addr, &cli->cold->cliaddr, sizeof(job->addr));
+    DEBUG_PRINTF(DEBUG_CLIENTS, "Looking up hostname of %s\n", cli->cold->hostname);
+
+    pthread_mutex_lock(&r->lock);
+    if (r->jobs_tail)
+        r->jobs_tail->next = job;
+    else
+        r->jobs_head = job;
+    r->jobs_tail = job;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+/* Handle the result of a lookup (MSG_RESOLVED): cache it, and hand it
+ * to the clients waiting for it, unless they have quit in the meantime.
+ */
+void handle_resolved(server_info_t* server_info, void* arg)
+{
+    resolver_t* r = server_info->resolver;
+    job_t* job = (job_t *) arg;
+    // Entries are never evicted while pending, so the slot is still ours
+    cache_entry_t* e = &r->entries[job->slot];
+    strcpy(e->hostname, job->hostname);
+    e->pending = FALSE;
+    e->expires = now() + (e->hostname[0] ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+
+    for (int i = 0; i < e->num_waiting; i++)
+    {
+        client_t* cli = find_client(&server_info->client_table, e->waiting[i]);
+        if (cli && e->hostname[0] && !cli->zombie)
+        {
+            DEBUG_PRINTF(DEBUG_CLIENTS, "Hostname of %s resolved: %s\n",
+                         cli->cold->hostname, e->hostname);
+            strcpy(cli->cold->hostname, e->hostname);
+            update_source(cli);
+        }
+    }
+    e->num_waiting = 0;
+    free(job);
+}
@@ -0,0 +1,35 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include "sircs.h"
+
+#define RESOLVER_THREADS 4
+#define RESOLVER_CACHE_SIZE 4096   // Addresses remembered
+#define RESOLVER_TTL 3600          // Seconds a hostname is trusted
+#define RESOLVER_NEGATIVE_TTL 60   // Seconds a failed lookup is trusted
+
+/**
+ * Asynchronous reverse DNS.
+ *
+ * A new client starts out with its numeric IP address as its hostname.
+ * The core loop then looks the address up in a bounded LRU cache, and on
+ * a miss, hands it to a pool of resolver threads, which run getnameinfo()
+ * and post the result back to the core loop's mailbox (MSG_RESOLVED).
+ * Concurrent lookups of the same address are merged: the clients wait on
+ * the cache entry until the result comes back.
+ *
+ * The clients waiting for a lookup are remembered by their handles (see
+ * client-table.h), so a client may quit and be freed before the result
+ * arrives, which then simply skips it.
+ *
+ * Everything but the resolver threads runs in the core loop.
+ */
+typedef struct resolver resolver_t;
+
+resolver_t* start_resolver(server_info_t* server_info, int num_threads);
+
+void resolve_client(server_info_t* server_info, client_t* cli);
+
+void handle_resolved(server_info_t* server_info, void* job);
+
+#endif /* _RESOLVER_H_ */
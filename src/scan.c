@@ -0,0 +1,33 @@
+#include "scan.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/**
+ * Find the first line delimiter ('\r' or '\n') among the |len| bytes
+ * at |p|. Returns its offset, or |len| if there is none.
+ */
+size_t scan_eol(const char* p, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (p[i] == '\r' || p[i] == '\n')
+            return i;
+    }
+    return len;
+}
@@ -0,0 +1,15 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/**
+ * Byte scanners for input framing and parsing.
+ *
+ * They work on (pointer, length) slices, so embedded NUL bytes are just
+ * ordinary bytes, and use SSE2 (16 bytes per step) where available.
+ */
+
+size_t scan_eol(const char* p, size_t len);
+
+#endif /* _SCAN_H_ */
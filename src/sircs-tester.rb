@@ -260,6 +260,18 @@ class IRC
         end
     end
 
+    def check1msg(from, to, msg)
+        data = recv_data_from_server(1);
+        msgs = data.grep(/PRIVMSG/)
+        if(msgs.length == 1 && msgs[0] =~ /^:#{from} *PRIVMSG *#{to} *:#{msg}/)
+            puts "\tPRIVMSG to #{to} only correct"
+            return true
+        else
+            puts "\tPRIVMSG to #{to} only incorrect"
+            return false
+        end
+    end
+
     def check_echojoin(from, channel)
 	reply_matches(/^:#{from}.*JOIN *#{channel}/,
 			    "Test if first client got join echo")
@@ -267,12 +279,12 @@ class IRC
 
     def part_channel(parter, channel)
         send("PART #{channel}")
-	reply_matches(/^:#{parter}![^ ]+@[^ ]+ *QUIT *:/) #fix----------------------------------------------------------------
+	reply_matches(/^:#{parter}![^ ]+@[^ ]+ *PART *#{channel}/)
 
     end
 
     def check_part(parter, channel)
-	reply_matches(/^:#{parter}![^ ]+@[^ ]+ *QUIT *:/) #fix----------------------------------------------------------------
+	reply_matches(/^:#{parter}![^ ]+@[^ ]+ *PART *#{channel}/)
     end
 
     def ignore_reply
@@ -445,6 +457,143 @@ class IRC
       return true
   end
 
+  def register(nick)
+      send_nick(nick)
+      send_user("#{nick} myHostname myServername :Tester #{nick}")
+      ignore_reply()
+  end
+
+  def names_packed(channel, nicks)
+      send("NAMES #{channel}")
+
+      data = recv_data_from_server(1);
+
+      names = data.grep(/^:[^ ]+ *353 /)
+      if(names.size == 1 and nicks.all? { |n| names[0] =~ /^:[^ ]+ *353 *[^ ]+ *= *#{channel} *:(.* )?#{n}( |\r|$)/ } and
+         data.size == 2 and data[1] =~ /^:[^ ]+ *366 *[^ ]+ *#{channel} *:End of \/NAMES list/)
+          return true
+      else
+          puts data
+          puts "NAMES #{channel} should pack #{nicks.join(' ')} into a single RPL_NAMREPLY, then RPL_ENDOFNAMES"
+          return false
+      end
+  end
+
+  def names_all(channel, lonely)
+      send("NAMES")
+
+      data = recv_data_from_server(1);
+
+      ends = data.grep(/^:[^ ]+ *366 /)
+      if(data.grep(/^:[^ ]+ *353 *[^ ]+ *= *#{channel} /).size == 1 and
+         data.grep(/^:[^ ]+ *353 *[^ ]+ *= *\* *:(.* )?#{lonely}( |\r|$)/).size == 1 and
+         ends.size == 1 and ends[0] == data[-1] and ends[0] =~ /^:[^ ]+ *366 *[^ ]+ *\* *:End of \/NAMES list/)
+          return true
+      else
+          puts data
+          puts "NAMES should list #{channel}, then #{lonely} on channel *, then a single RPL_ENDOFNAMES for *"
+          return false
+      end
+  end
+
+  def names_unknown(channel)
+      send("NAMES #{channel}")
+
+      data = recv_data_from_server(1);
+
+      if(data.size == 1 and data[0] =~ /^:[^ ]+ *366 *[^ ]+ *#{channel} *:End of \/NAMES list/)
+          return true
+      else
+          puts data
+          puts "NAMES #{channel} should only return RPL_ENDOFNAMES"
+          return false
+      end
+  end
+
+  def multi_join(nick, channels)
+      send("JOIN #{channels.join(',')}")
+
+      data = recv_data_from_server(1);
+
+      channels.each do |ch|
+          if (data.grep(/^:#{nick}![^ ]+@[^ ]+ *JOIN *#{ch}/).size != 1 or
+              data.grep(/^:[^ ]+ *366 *#{nick} *#{ch} /).size != 1)
+              puts data
+              puts "JOIN #{channels.join(',')} should join each channel, with its own echo and names"
+              return false
+          end
+      end
+      return true
+  end
+
+  def multi_part(nick, channels)
+      send("PART #{channels.join(',')}")
+      return check_multi_part(nick, channels)
+  end
+
+  def check_multi_part(nick, channels)
+      data = recv_data_from_server(1);
+
+      parts = data.grep(/^:#{nick}![^ ]+@[^ ]+ *PART /)
+      if(parts.size == channels.size and
+         channels.each_with_index.all? { |ch, i| parts[i] =~ /PART *#{ch}/ })
+          return true
+      else
+          puts data
+          puts "PART #{channels.join(',')} should be echoed once for each channel"
+          return false
+      end
+  end
+
+  def check_once(nick, cmd)
+      data = recv_data_from_server(1);
+
+      if(data.size == 1 and data[0] =~ /^:#{nick}![^ ]+@[^ ]+ *#{cmd}/)
+          return true
+      else
+          puts data
+          puts "A peer on several channels should get a single #{cmd} from #{nick}"
+          return false
+      end
+  end
+
+  def list_only(params, wanted, unwanted)
+      send("LIST #{params}")
+
+      data = recv_data_from_server(1);
+
+      listed = data.grep(/^:[^ ]+ *322 /).map { |l| l.split[3] }
+      if(data[0] =~ /^:[^ ]+ *321 / and data[-1] =~ /^:[^ ]+ *323 *[^ ]+ *:End of \/LIST/ and
+         (wanted - listed).empty? and (unwanted & listed).empty?)
+          return true
+      else
+          puts data
+          puts "LIST #{params} should list #{wanted.join(' ')}, but not #{unwanted.join(' ')}"
+          return false
+      end
+  end
+
+  def who_only(params, wanted, unwanted)
+      send(params.empty? ? "WHO" : "WHO #{params}")
+
+      data = recv_data_from_server(1);
+
+      # Each target gets its own RPL_ENDOFWHO, after its replies
+      targets = params.empty? ? ["*"] : params.split(',')
+      targets = [params] if targets.empty?
+      ends = data.each_index.select { |i| data[i] =~ /^:[^ ]+ *315 / }
+      listed = data.grep(/^:[^ ]+ *352 /).map { |l| l.split[7] }
+      if(ends.size == targets.size and ends[-1] == data.size - 1 and
+         targets.each_with_index.all? { |t, i| data[ends[i]] =~ /315 *[^ ]+ *#{Regexp.escape(t)} *:End of \/WHO list/ } and
+         (wanted - listed).empty? and (unwanted & listed).empty?)
+          return true
+      else
+          puts data
+          puts "WHO #{params} should list #{wanted.join(' ')}, but not #{unwanted.join(' ')}, with one RPL_ENDOFWHO per target"
+          return false
+      end
+  end
+
 end
 
 
@@ -599,15 +748,16 @@ begin
 # A client should be able to send a single message to
 # multiple targets, with ',' as a delimiter.
 # We use client2 to send a message to rui and #linux.
-# Both should receive the message.
+# rui, who is on #linux too, should receive the message once,
+# through the first target that reaches them.
    tn = test_name("MULTI-TARGET PRIVMSG")
    msg = "success is 1 pcent inspiration and 99 pcent perspiration"
    irc2.send_privmsg("rui,#linux", msg)
-   eval_test(tn, nil, nil, irc.check2msg("rui2", "rui", "#linux", msg))
+   eval_test(tn, nil, nil, irc.check1msg("rui2", "rui", msg))
    irc2.ignore_reply()
 
 ############## PART ###################
-# When a client parts a channel, a QUIT message
+# When a client parts a channel, a PART message
 # is sent to all clients in the channel, including
 # the client that is parting.
    tn = test_name("PART")
@@ -640,6 +790,11 @@ begin
     tn = test_name("USED_NICKNAME")
     eval_test(tn, nil, nil, irc.used_nick("rui2"))
 
+# Nicknames are compared without regard to case (RFC 1459 casemapping)
+
+    tn = test_name("USED_NICKNAME_CASEMAPPING")
+    eval_test(tn, nil, nil, irc.used_nick("RUI2"))
+
 # NO_NICK_NAME_GIVEN
 # NICK <blank> should return ERR_NONICKNAMEGIVEN
 
@@ -724,6 +879,143 @@ begin
     tn = test_name("SEND_TO_NONEXISTENT_TARGET")
     eval_test(tn, nil, nil, irc.nonexistent_target(targets))
 
+############## NAMES ###################
+# NAMES <channel> packs the members of a channel into as few RPL_NAMREPLY
+# lines as fit. Without a parameter, every channel is listed, then the
+# clients on no channel as members of "*", and a single RPL_ENDOFNAMES
+# for "*" ends the whole reply.
+
+   names1 = IRC.new($SERVER, $PORT, '', '')
+   names1.connect()
+   names1.register("names1")
+   names1.raw_join_channel("names1", "#names")
+   names2 = IRC.new($SERVER, $PORT, '', '')
+   names2.connect()
+   names2.register("names2")
+   names2.raw_join_channel("names2", "#names")
+   names1.ignore_reply()
+   names3 = IRC.new($SERVER, $PORT, '', '')
+   names3.connect()
+   names3.register("names3")
+
+   tn = test_name("NAMES_PACKED")
+   eval_test(tn, nil, nil, names1.names_packed("#names", ["names1", "names2"]))
+
+   tn = test_name("NAMES_ALL")
+   eval_test(tn, nil, nil, names1.names_all("#names", "names3"))
+
+   tn = test_name("NAMES_UNKNOWN_CHANNEL")
+   eval_test(tn, nil, nil, names1.names_unknown("#nonames"))
+
+   names1.disconnect()
+   names2.disconnect()
+   names3.disconnect()
+
+############## MULTI-CHANNEL MEMBERSHIP ###################
+# A client may be on several channels at once. JOIN and PART take a list
+# of channels, and are echoed on each of them. A NICK or QUIT reaches
+# each peer once, however many channels they share.
+
+   multi1 = IRC.new($SERVER, $PORT, '', '')
+   multi1.connect()
+   multi1.register("multi1")
+   multi2 = IRC.new($SERVER, $PORT, '', '')
+   multi2.connect()
+   multi2.register("multi2")
+   multi3 = IRC.new($SERVER, $PORT, '', '')
+   multi3.connect()
+   multi3.register("multi3")
+   channels = ["#multi1", "#multi2"]
+
+   tn = test_name("MULTI_JOIN")
+   eval_test(tn, nil, nil, multi1.multi_join("multi1", channels))
+   multi2.raw_join_channel("multi2", channels.join(','))
+   multi3.raw_join_channel("multi3", channels.join(','))
+   multi1.ignore_reply()
+   multi2.ignore_reply()
+
+   tn = test_name("NICK_ONCE_PER_PEER")
+   multi2.send_nick("multi2new")
+   eval_test(tn, nil, nil, multi1.check_once("multi2", "NICK *:?multi2new"))
+   multi3.ignore_reply()
+
+   tn = test_name("MULTI_PART")
+   eval_test("MULTI_PART echo to self", nil, nil,
+         multi2.multi_part("multi2new", channels), 0)
+   eval_test(tn, nil, nil, multi1.check_multi_part("multi2new", channels))
+   multi3.ignore_reply()
+
+   tn = test_name("QUIT_ONCE_PER_PEER")
+   multi3.send("QUIT :bye")
+   eval_test(tn, nil, nil, multi1.check_once("multi3", "QUIT"))
+
+   multi1.disconnect()
+   multi2.disconnect()
+   multi3.disconnect()
+
+############## LIST CONDITIONS ###################
+# LIST takes a comma-separated list of conditions: ">n" and "<n" (more or
+# fewer than n users), masks, and "!" before a mask to leave channels out.
+
+   list1 = IRC.new($SERVER, $PORT, '', '')
+   list1.connect()
+   list1.register("list1")
+   list1.raw_join_channel("list1", "#lbig,#lsmall,#other")
+   list2 = IRC.new($SERVER, $PORT, '', '')
+   list2.connect()
+   list2.register("list2")
+   list2.raw_join_channel("list2", "#lbig")
+   list1.ignore_reply()
+
+   tn = test_name("LIST_MORE_USERS")
+   eval_test(tn, nil, nil, list1.list_only(">1", ["#lbig"], ["#lsmall", "#other"]))
+
+   tn = test_name("LIST_FEWER_USERS")
+   eval_test(tn, nil, nil, list1.list_only("<2", ["#lsmall", "#other"], ["#lbig"]))
+
+   tn = test_name("LIST_MASK")
+   eval_test(tn, nil, nil, list1.list_only("#L*", ["#lbig", "#lsmall"], ["#other"]))
+
+   tn = test_name("LIST_EXCLUDE")
+   eval_test(tn, nil, nil, list1.list_only("#l*,!#lsm?ll", ["#lbig"], ["#lsmall", "#other"]))
+
+   list1.disconnect()
+   list2.disconnect()
+
+############## WHO MASKS AND TARGETS ###################
+# WHO takes a comma-separated list of channels, nicknames and masks, each
+# ended by its own RPL_ENDOFWHO. Without a parameter, it lists the clients
+# who share no channel with the asker, ended by RPL_ENDOFWHO for "*".
+
+   who1 = IRC.new($SERVER, $PORT, '', '')
+   who1.connect()
+   who1.register("who1")
+   who1.raw_join_channel("who1", "#who")
+   who2 = IRC.new($SERVER, $PORT, '', '')
+   who2.connect()
+   who2.register("who2")
+   who2.raw_join_channel("who2", "#who")
+   who1.ignore_reply()
+   who3 = IRC.new($SERVER, $PORT, '', '')
+   who3.connect()
+   who3.register("who3")
+
+   tn = test_name("WHO_MASK")
+   eval_test(tn, nil, nil, who1.who_only("WHO?", ["who1", "who2", "who3"], ["rui"]))
+
+   tn = test_name("WHO_PER_TARGET")
+   eval_test(tn, nil, nil, who1.who_only("#who,who3,nobody*", ["who1", "who2", "who3"], ["rui"]))
+
+   tn = test_name("WHO_NO_TARGET")
+   eval_test(tn, nil, nil, who1.who_only(",", [], ["who1", "who2", "who3", "rui"]))
+
+   tn = test_name("WHO_NO_PARAM")
+   eval_test(tn, nil, nil, who1.who_only("", ["who3", "rui"], ["who1", "who2"]))
+
+   who1.disconnect()
+   who2.disconnect()
+   who3.disconnect()
+
 # Things you might want to test:
 #  - Multiple clients in a channel
 #  - Abnormal messages of various sorts
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,38 +11,101 @@
 #include <assert.h>
 #include <fcntl.h>      // fcntl()
 #include <errno.h>      // errno
-#include <sys/select.h> // select(), fd_set, etc.
+#include <sys/resource.h> // setrlimit()
 #include <signal.h>
+#include <pthread.h>
+#include <netinet/tcp.h> // TCP_DEFER_ACCEPT, TCP_INFO
 
 #include "sircs.h"
 #include "debug.h"
 #include "irc-proto.h"
+#include "io-engine.h"
+#include "resolver.h"
+#include "scan.h"
 
 
 void usage() {
-    eprintf("sircs [-h] [-D debugLevel] <port>\n");
+    eprintf("sircs [-h] [-D debugLevel] [-e epoll|uring] [-t threads] [-b backlog] [-d deferSecs] [-q sendq] [-C] [-P prealloc] <port>\n");
     exit(-1);
 }
 
 
 
+/* Set when accept statistics are requested (SIGUSR1). */
+static volatile sig_atomic_t stats_requested = 0;
+
+static void request_stats(int signo)
+{
+    stats_requested = 1;
+}
+
+
+
 int main(int argc, char *argv[] ){
     
     signal(SIGPIPE, SIG_IGN); /* Block SIGPIPE Signals */
     
+    // SIGUSR1 dumps the accept statistics. No SA_RESTART, so that the
+    // core loop wakes up to do it.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    
     DEBUG_PRINTF(DEBUG_INIT, "Hello\n");
     
     // Parse args
     extern char *optarg;
     extern int optind;
     int ch;
+    const io_engine_t* engine = &epoll_engine;
+    int num_loops = 1;
+    int backlog = DEFAULT_BACKLOG;
+    int defer_secs = 0;
+    long sendq_max = DEFAULT_SENDQ;
+    int cork = FALSE;
+    long prealloc = DEFAULT_PREALLOC;
     
-    while ((ch = getopt(argc, argv, "hD:")) != -1)
+    while ((ch = getopt(argc, argv, "hD:e:t:b:d:q:CP:")) != -1)
         switch (ch){
             case 'D':
                 if (set_debug(optarg))
                     exit(-1);
                 break;
+            case 'e':
+                engine = find_engine(optarg);
+                if (!engine)
+                    usage();
+                break;
+            case 't':
+                num_loops = atoi(optarg);
+                if (num_loops < 1)
+                    usage();
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                if (backlog < 1)
+                    usage();
+                break;
+            case 'd':
+                defer_secs = atoi(optarg);
+                if (defer_secs < 0)
+                    usage();
+                break;
+            case 'q':
+                sendq_max = atol(optarg);
+                if (sendq_max < RFC_MAX_MSG_LEN)
+                    usage();
+                break;
+            case 'C':
+                cork = TRUE;
+                break;
+            case 'P':
+                prealloc = atol(optarg);
+                if (prealloc < 0 || prealloc > MAX_CLIENTS)
+                    usage();
+                break;
             case 'h':
             default: /* FALLTHROUGH */
                 usage();
@@ -71,52 +135,19 @@ int main(int argc, char *argv[] ){
     /* Initialize server */
     
     int __rc; // for return codes
-    struct sockaddr_in srv_addr;
-    
-    // Create listening socket
-    int listenfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    exit_on_error(listenfd, "socket() failed");
-    
-    // Enable address reuse
-    const int reuse = 1;
-    __rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    exit_on_error(__rc, "setsockopt() failed");
-    
-    // Make listening socket non-blocking
-    __rc = set_non_blocking(listenfd);
-    exit_on_error(__rc, "");
-    
-    // Initialize sockaddr
-    memset(&srv_addr, '\0', sizeof(srv_addr));
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    srv_addr.sin_port = htons(port);
-    
-    // Bind listening socket to the specified port
-    __rc = bind(listenfd, (struct sockaddr *) &srv_addr, sizeof(struct sockaddr));
-    exit_on_error(__rc, "bind() failed");
-    
-    // Listen
-    __rc = listen(listenfd, 1);
-    exit_on_error(__rc, "listen() failed");
-    
-    // Set up file descriptors pool
-    fd_set fds;
-    
-    // Time-out
-    //    struct timeval timeout; // FIXME: does not work on Linux
-    //    timeout.tv_sec = 1;
-    //    timeout.tv_usec = 0;
-    
     
     /* Initialize server_info struct */
     server_info_t server_info;
     memset(&server_info, '\0', sizeof(server_info));
+    server_info.sendq_max = sendq_max;
+    server_info.cork = cork;
     
     // Get server hostname
     size_t hostname_len = sizeof(server_info.hostname);
     server_info.hostname[hostname_len-1] = '\0';
     gethostname(server_info.hostname, hostname_len-1);
+    server_info.prefix_len = snprintf(server_info.prefix, sizeof(server_info.prefix),
+                                      ":%s ", server_info.hostname);
     
     // Client list
     LinkedList* clients = malloc(sizeof(LinkedList));
@@ -128,85 +159,302 @@ int main(int argc, char *argv[] ){
     init_list(zombies);
     server_info.zombies = zombies;
     
+    // LIST and WHO replies in progress
+    LinkedList* streams = malloc(sizeof(LinkedList));
+    init_list(streams);
+    server_info.streams = streams;
+    
+    // Client handles
+    if (init_client_table(&server_info.client_table, MAX_CLIENTS) < 0)
+        exit_on_error(-1, "Cannot allocate client table");
+    
+    // Nickname index
+    init_table(&server_info.nicks, 1024);
+    
     // Channel list
     LinkedList* channels = malloc(sizeof(LinkedList));
     init_list(channels);
     server_info.channels = channels;
+    init_table(&server_info.chan_names, 1024);
+    
+    // Channel pool, preallocated for |prealloc| clients (each of which may
+    // have a channel of its own). The clients come from the pools of the
+    // event loops (see below).
+    init_pool(&server_info.channel_pool, "channel", sizeof(channel_t), POOL_SLAB_OBJS);
+    if (pool_reserve(&server_info.channel_pool, prealloc) < 0)
+        exit_on_error(-1, "Cannot preallocate channels");
     
-    DEBUG_PRINTF(DEBUG_INIT, "Simple IRC server listening on %s:%d, fd=%d\n",
+    // Raise the open file limit so that we can actually hold MAX_CLIENTS sockets
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    
+    // Reverse DNS lookups, off the event loops
+    server_info.resolver = start_resolver(&server_info, RESOLVER_THREADS);
+    if (!server_info.resolver)
+        exit_on_error(-1, "Cannot start resolver");
+    
+    // Event loops: the core loop (run by this thread) handles all commands
+    // and writes all replies; each extra loop runs in its own thread, with its
+    // own listening socket, and only accepts and reads
+    io_loop_t* loops = calloc(num_loops, sizeof(io_loop_t));
+    for (int i = 0; i < num_loops; i++)
+    {
+        int listenfd = open_listener(port, num_loops > 1, backlog, defer_secs);
+        if (init_loop(&loops[i], i, engine, &server_info, listenfd) < 0)
+        {
+            if (engine == &epoll_engine || i > 0)
+                exit(1);
+            eprintf("I/O engine %s unavailable, falling back to %s\n",
+                    engine->name, epoll_engine.name);
+            engine = &epoll_engine;
+            __rc = init_loop(&loops[i], i, engine, &server_info, listenfd);
+            exit_on_error(__rc, "Cannot initialize event loop");
+        }
+    }
+    server_info.loop = &loops[0];
+    server_info.num_loops = num_loops;
+    
+    // Each loop's pools are preallocated for its share of |prealloc| clients
+    // (incomplete messages are rare: none of them are reserved)
+    for (int i = 0; i < num_loops; i++)
+    {
+        size_t share = (prealloc + num_loops - 1) / num_loops;
+        if (pool_reserve(&loops[i].client_pool, share) < 0 ||
+            pool_reserve(&loops[i].cold_pool, share) < 0)
+            exit_on_error(-1, "Cannot preallocate clients");
+    }
+    
+    DEBUG_PRINTF(DEBUG_INIT, "Simple IRC server listening on %s:%d, engine=%s, %d loop(s), backlog=%d\n",
             server_info.hostname,
             port,
-            listenfd);
+            engine->name,
+            num_loops,
+            backlog);
     
-    // Start main server loop
-    while (TRUE)
+    // Only the core loop handles SIGUSR1: block it in the worker threads
+    sigset_t usr1, old_mask;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, &old_mask);
+    for (int i = 1; i < num_loops; i++)
     {
-        int highfd = build_fd_set(&fds, listenfd, server_info.clients);
-        int ready  = select(highfd + 1, &fds, (fd_set *) 0, (fd_set *) 0, NULL);
-        exit_on_error(ready, "select() failed");
-        
-        if (ready == 0)
+        pthread_t thread;
+        __rc = pthread_create(&thread, NULL, run_worker_loop, &loops[i]);
+        if (__rc)
         {
-            DEBUG_PRINTF(DEBUG_CLIENTS, ".");
-            fflush(stdout);
+            errno = __rc;
+            exit_on_error(-1, "pthread_create() failed");
         }
-        else // ready > 0
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    
+    // Start main server loop
+    io_loop_t* loop = server_info.loop;
+    while (TRUE)
+    {
+        __rc = loop->engine->wait(loop);
+        exit_on_error(__rc, "Event loop failed");
+        // Send everything the handlers have queued during this batch, and
+        // one more page of each long reply in progress that its client can take
+        flush_output(&server_info);
+        if (continue_streams(&server_info))
+            flush_output(&server_info);
+        // The rest waits for the next tick, after the other clients' events,
+        // which must then come at once if a page can already go out
+        if (streams_ready(&server_info))
+            mailbox_wake(&loop->mailbox);
+        // Clients are only freed once no event of this batch can refer to them
+        reap_zombies(&server_info);
+        if (stats_requested)
         {
-            DEBUG_PRINTF(DEBUG_CLIENTS, "\n");
-            // Accept a new connection
-            if (FD_ISSET(listenfd, &fds))
+            stats_requested = 0;
+            report_accept_stats(&server_info);
+            for (int i = 0; i < num_loops; i++)
             {
-                handle_new_connection(listenfd, server_info.clients);
+                eprintf("[loop %d] pools:\n", i);
+                report_pool_stats(&loops[i].client_pool);
+                report_pool_stats(&loops[i].cold_pool);
+                report_pool_stats(&loops[i].partial_pool);
             }
-            // Check activities from connected sockets
-            ITER_LOOP(it, server_info.clients)
-            {
-                client_t* cli = (client_t *) iter_get_item(it);
-                if (FD_ISSET(cli->sock, &fds))
-                {
-                    DEBUG_PRINTF(DEBUG_CLIENTS, "Active fd=%i\n", cli->sock);
-                    __rc = handle_data(&server_info, cli);
-                    // If something went wrong, fake a QUIT command
-                    if (__rc < 0)
-                    {
-                        cli->registered = 1; // Ugly but quick fix
-                        handle_line("QUIT", &server_info, cli);
-                    }
-                }
-            } /* Iterator loop */
-            iter_clean(it);
+            report_pool_stats(&server_info.channel_pool);
         }
     }
-    close(listenfd);
     
     return 0;
 }
 
 
 
-/* Build fd_set in |fds| given the listening socket |listenfd| and
- * client sockets |clients| array.
+/* Create a non-blocking socket listening on |port|, with room for
+ * |backlog| connections waiting to be accepted.
+ * With |reuseport| set, several such sockets may listen on the same port,
+ * and the kernel spreads the incoming connections among them.
+ * With |defer_secs| > 0, a connection is only reported once the client has
+ * sent something (or after about |defer_secs| seconds).
  */
-int build_fd_set(fd_set *fds, int listenfd, LinkedList* clients)
+int open_listener(uint16_t port, int reuseport, int backlog, int defer_secs)
 {
-    int highfd = listenfd;
-    FD_ZERO(fds);
-    FD_SET(listenfd, fds);
-    // update highfd
-    ITER_LOOP(it, clients)
-    {
-        client_t* cli = (client_t *) iter_get_item(it);
-        int fd = cli->sock;
-        FD_SET(fd, fds); // Register this socket
-        if (fd > highfd) // Update |highfd| if necessary
-            highfd = fd;
-    }
-    iter_clean(it);
-    return highfd;
+    int __rc; // for return codes
+    struct sockaddr_in srv_addr;
+    
+    // Create listening socket
+    int listenfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    exit_on_error(listenfd, "socket() failed");
+    
+    // Enable address reuse
+    const int reuse = 1;
+    __rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    exit_on_error(__rc, "setsockopt() failed");
+    if (reuseport)
+    {
+        __rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        exit_on_error(__rc, "setsockopt(SO_REUSEPORT) failed");
+    }
+    if (defer_secs > 0)
+    {
+        __rc = setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs, sizeof(defer_secs));
+        exit_on_error(__rc, "setsockopt(TCP_DEFER_ACCEPT) failed");
+    }
+    
+    // Make listening socket non-blocking
+    __rc = set_non_blocking(listenfd);
+    exit_on_error(__rc, "");
+    
+    // Initialize sockaddr
+    memset(&srv_addr, '\0', sizeof(srv_addr));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    srv_addr.sin_port = htons(port);
+    
+    // Bind listening socket to the specified port
+    __rc = bind(listenfd, (struct sockaddr *) &srv_addr, sizeof(struct sockaddr));
+    exit_on_error(__rc, "bind() failed");
+    
+    // Listen
+    __rc = listen(listenfd, backlog);
+    exit_on_error(__rc, "listen() failed");
+    return listenfd;
+}
+
+
+
+/* Run a worker loop (in its own thread).
+ * A worker loop accepts connections on its own listening socket and reads
+ * from its clients' sockets, but passes everything else on to the core loop:
+ * it never runs a command handler, never writes to a socket, and never looks
+ * at the registries of nicknames and channels.
+ */
+void* run_worker_loop(void* arg)
+{
+    io_loop_t* loop = (io_loop_t *) arg;
+    while (TRUE)
+    {
+        int __rc = loop->engine->wait(loop);
+        exit_on_error(__rc, "Event loop failed");
+    }
+    return NULL;
+}
+
+
+
+static void fake_quit(server_info_t* server_info, client_t* cli);
+static void free_client(client_t* cli);
+
+
+
+/* Whether the client is served by the core loop, which also runs the
+ * command handlers. Any other client is served by a worker loop, and
+ * only that loop may touch the client's socket input and input buffer.
+ */
+static int served_by_core(server_info_t* server_info, client_t* cli)
+{
+    return cli->loop == server_info->loop;
 }
 
 
 
+/* Record a new client in the server's state (core loop only): give it a
+ * handle, add it to the |clients| list, and start looking up its hostname.
+ */
+static void register_client(server_info_t* server_info, client_t* cli)
+{
+    // Cannot fail: there are never more than MAX_CLIENTS clients
+    claim_handle(&server_info->client_table, cli);
+    add_node(server_info->clients, &cli->node_clients);
+    resolve_client(server_info, cli);
+}
+
+
+
+/* Handle the messages posted to a loop's mailbox.
+ *
+ * The core loop owns the server's state (clients, nicknames and channels),
+ * so the other loops never touch it, and it needs no locking at all.
+ * Instead, a worker loop posts to the core loop:
+ *   MSG_CONNECT   when it has accepted a new client,
+ *   MSG_LINE      for each complete message from a client,
+ *   MSG_HANGUP    when a client's connection is gone, and
+ *   MSG_RELEASED  when it has closed a client's socket,
+ * and the core loop posts MSG_RELEASE to a worker loop when one of its
+ * clients has quit, and then MSG_FREE once it is done with the client,
+ * whose memory goes back to the worker loop's pools. Replies are written
+ * by the core loop directly.
+ * The resolver threads post MSG_RESOLVED to the core loop with the
+ * hostnames they have looked up.
+ */
+void handle_messages(io_loop_t* loop)
+{
+    server_info_t* server_info = loop->server_info;
+    mailbox_ack(&loop->mailbox);
+    Message* msg;
+    while ((msg = mailbox_take(&loop->mailbox)) != NULL)
+    {
+        client_t* cli = (client_t *) msg->item;
+        switch (msg->type)
+        {
+            case MSG_CONNECT:
+                register_client(server_info, cli);
+                break;
+            case MSG_LINE:
+                if (!cli->zombie)
+                    handle_line(msg->data, msg->len, server_info, cli);
+                break;
+            case MSG_HANGUP:
+                fake_quit(server_info, cli);
+                break;
+            case MSG_RELEASE:
+                // Only this loop may close the socket, as it might be using it
+                loop->engine->unwatch(loop, cli);
+                close(cli->sock);
+                // The message goes back as the answer
+                msg->type = MSG_RELEASED;
+                mailbox_post(&server_info->loop->mailbox, msg);
+                continue;
+            case MSG_RELEASED:
+                // No more messages about this client: it can now be freed,
+                // and the message is kept for that (see |reap_zombies()|)
+                cli->released = TRUE;
+                cli->cold->release_msg = msg;
+                continue;
+            case MSG_FREE:
+                free_client(cli);
+                break;
+            case MSG_RESOLVED:
+                handle_resolved(server_info, msg->item);
+                break;
+        }
+        free(msg);
+    }
+}
+
+
+
+
+
 /* Set file descriptor |fd| to be non-blocking.
  */
 int set_non_blocking(int fd)
@@ -230,214 +478,611 @@ int set_non_blocking(int fd)
 
 
 
-/* Handle new incoming client connection on |listenfd| as reported by select()
- * If the connection can and has been accepted, then
- *   - update |clients| array to record this client's info,
- *   - increment the number of existing connections |num_clients| by 1.
- *
- * The connection will be closed immediately after being accepted if
- *   - the number of existing connections has reached |MAX_CLIENTS|, or
- *   - cannot set connection socket to be non-blocking
- *   - cannot retrieve client's hostname using getnameinfo().
+/* Handle new incoming client connections on the loop's listening socket
+ * as reported by epoll: accept them all, until the accept queue is empty.
+ * Returns the number of connections accepted, or -1 on error.
+ */
+int handle_new_connection(io_loop_t* loop)
+{
+    int listenfd = loop->listenfd;
+    int accepted = 0;
+    while (TRUE)
+    {
+        struct sockaddr_in cli_addr;
+        socklen_t cli_addr_len = sizeof(cli_addr);
+        memset(&cli_addr, 0, cli_addr_len);
+        // Sockets come out non-blocking already
+        int sock = accept4(listenfd, (struct sockaddr *) &cli_addr, &cli_addr_len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            // The connection was reset while queued: try the next one
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            // Out of descriptors (or worse): leave the rest queued for now
+            __atomic_add_fetch(&loop->accept_errors, 1, __ATOMIC_RELAXED);
+            perror("accept() failed");
+            return accepted ? accepted : -1;
+        }
+        accept_client(loop, sock, &cli_addr);
+        accepted++;
+    }
+    if (accepted > loop->accept_batch_max)
+        __atomic_store_n(&loop->accept_batch_max, accepted, __ATOMIC_RELAXED);
+    return accepted;
+}
+
+
+
+/* Read a counter from the TcpExt section of /proc/net/netstat.
+ * Returns -1 if unavailable.
  */
-int handle_new_connection(int listenfd, LinkedList* clients)
+static long read_tcpext_counter(const char* name)
 {
-    // Accept any new connection
-    struct sockaddr_in cli_addr;
-    socklen_t cli_addr_len = sizeof(cli_addr);
-    memset(&cli_addr, 0, cli_addr_len);
-    int sock = accept(listenfd, (struct sockaddr *) &cli_addr, &cli_addr_len);
-    if (sock < 0)
-    {
-        perror("accept() failed");
+    FILE* f = fopen("/proc/net/netstat", "r");
+    if (!f)
         return -1;
+    // The section is a line of names followed by a line of values
+    char names[4096], values[4096];
+    long result = -1;
+    while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f))
+    {
+        if (strncmp(names, "TcpExt:", 7))
+            continue;
+        char *name_save, *value_save;
+        char* n = strtok_r(names, " \n", &name_save);
+        char* v = strtok_r(values, " \n", &value_save);
+        while (n && v)
+        {
+            if (!strcmp(n, name))
+            {
+                result = atol(v);
+                break;
+            }
+            n = strtok_r(NULL, " \n", &name_save);
+            v = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
     }
-    if (clients->size == MAX_CLIENTS)
+    fclose(f);
+    return result;
+}
+
+
+
+/* Print the accept statistics of every loop (on SIGUSR1): connections
+ * accepted, accept errors, largest batch drained at once, and the current
+ * length and size of the accept queue. The kernel's overflow counters
+ * are host-wide: they tell whether the backlog (-b) is large enough.
+ */
+void report_accept_stats(server_info_t* server_info)
+{
+    io_loop_t* loops = server_info->loop;
+    for (int i = 0; i < server_info->num_loops; i++)
+    {
+        io_loop_t* loop = &loops[i];
+        struct tcp_info info;
+        socklen_t info_len = sizeof(info);
+        memset(&info, 0, sizeof(info));
+        // For a listening socket, the kernel reports the accept queue
+        // length as |tcpi_unacked| and the backlog as |tcpi_sacked|
+        getsockopt(loop->listenfd, IPPROTO_TCP, TCP_INFO, &info, &info_len);
+        eprintf("[loop %d] accepted=%lu errors=%lu max_batch=%d queue=%u/%u\n",
+                loop->id,
+                __atomic_load_n(&loop->accepted, __ATOMIC_RELAXED),
+                __atomic_load_n(&loop->accept_errors, __ATOMIC_RELAXED),
+                __atomic_load_n(&loop->accept_batch_max, __ATOMIC_RELAXED),
+                info.tcpi_unacked,
+                info.tcpi_sacked);
+    }
+    eprintf("ListenOverflows=%ld ListenDrops=%ld\n",
+            read_tcpext_counter("ListenOverflows"),
+            read_tcpext_counter("ListenDrops"));
+}
+
+
+
+/* Allocate a client accepted by |loop|, with its cold record, all zeroed.
+ */
+static client_t* new_client(io_loop_t* loop)
+{
+    client_t* cli = (client_t *) pool_alloc(&loop->client_pool);
+    if (!cli)
+        return NULL;
+    memset(cli, 0, sizeof(*cli));
+    cli->cold = (client_cold_t *) pool_alloc(&loop->cold_pool);
+    if (!cli->cold)
+    {
+        pool_free(&loop->client_pool, cli);
+        return NULL;
+    }
+    memset(cli->cold, 0, sizeof(*cli->cold));
+    cli->loop = loop;
+    return cli;
+}
+
+
+/* Give a client back to the pools of its loop (on that loop only).
+ */
+static void free_client(client_t* cli)
+{
+    io_loop_t* loop = cli->loop;
+    free(cli->cold->hangup_msg);
+    free(cli->cold->release_msg);
+    if (cli->cold->partial)
+        pool_free(&loop->partial_pool, cli->cold->partial);
+    pool_free(&loop->cold_pool, cli->cold);
+    pool_free(&loop->client_pool, cli);
+}
+
+
+
+/* Record the client connected on the (non-blocking) socket |sock|,
+ * accepted by |loop|. If the connection can be accepted, then
+ *   - start watching the client's socket in |loop|,
+ *   - update the server's |clients| list to record this client's info
+ *     (through the core loop's mailbox if |loop| is a worker loop),
+ *   - start looking up the client's hostname (see resolver.h).
+ *
+ * The connection will be closed immediately if
+ *   - the number of existing connections has reached |MAX_CLIENTS|, or
+ *   - cannot watch the client's socket.
+ */
+int accept_client(io_loop_t* loop, int sock, struct sockaddr_in* cli_addr)
+{
+    server_info_t* server_info = loop->server_info;
+    __atomic_add_fetch(&loop->accepted, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&server_info->num_clients, 1, __ATOMIC_RELAXED) > MAX_CLIENTS)
     {
         DEBUG_PRINTF(DEBUG_SOCKETS, "No room for new connections\n");
+        __atomic_sub_fetch(&server_info->num_clients, 1, __ATOMIC_RELAXED);
         close(sock);
         return -1;
     }
     
     // Ready to record client information
-    client_t* cli = (client_t *) malloc(sizeof(client_t));
-    memset(cli, 0, sizeof(*cli));
-    
-    
-    // Initialize connection socket
-    if (set_non_blocking(sock) < 0)
+    client_t* cli = new_client(loop);
+    if (!cli)
     {
+        __atomic_sub_fetch(&server_info->num_clients, 1, __ATOMIC_RELAXED);
         close(sock);
         return -1;
     }
     cli->sock = sock;
-    
-    // Reverse lookup client's hostname
-    char host_buf[NI_MAXHOST], serv_buf[NI_MAXSERV];
-    if (getnameinfo((struct sockaddr *) &cli_addr, sizeof(cli_addr),
-                    host_buf, sizeof(host_buf),
-                    serv_buf, sizeof(serv_buf),
-                    0))
+
+    // A client of a worker loop is only known to the core loop through
+    // messages, and must be dropped if they cannot all be allocated
+    Message* connect_msg = NULL;
+    if (!served_by_core(server_info, cli))
     {
-        perror("Failed to reverse lookup client's hostname");
-        close(sock);
-        return -1;
+        connect_msg = new_message(MSG_CONNECT, cli, NULL, 0);
+        cli->cold->hangup_msg = new_message(MSG_HANGUP, cli, NULL, 0);
+        cli->cold->release_msg = new_message(MSG_RELEASE, cli, NULL, 0);
+        if (!connect_msg || !cli->cold->hangup_msg || !cli->cold->release_msg)
+        {
+            __atomic_sub_fetch(&server_info->num_clients, 1, __ATOMIC_RELAXED);
+            close(sock);
+            free(connect_msg);
+            free_client(cli);
+            return -1;
+        }
     }
+    // Serial numbers tell apart successive clients on the same socket
+    do {
+        cli->serial = __atomic_add_fetch(&server_info->next_serial, 1, __ATOMIC_RELAXED);
+    } while (cli->serial == 0);
     
-    // Initialize hostname (always NUL-terminated), and truncate if necessary
-    strncpy(cli->hostname, host_buf, MIN( strlen(host_buf),
-                                          MAX_HOSTNAME-1 ));  // -1 for the last '\0'
+    // The hostname is the numeric address until the lookup completes
+    inet_ntop(AF_INET, &cli_addr->sin_addr, cli->cold->hostname, sizeof(cli->cold->hostname));
     
     // Initialize various fields
-    memcpy(&(cli->cliaddr), &cli_addr, sizeof(cli_addr));
-    cli->inbuf_size = 0;
+    memcpy(&(cli->cold->cliaddr), cli_addr, sizeof(*cli_addr));
+    init_outq(&cli->outq);
+    
+    if (loop->engine->watch(loop, cli) < 0)
+    {
+        __atomic_sub_fetch(&server_info->num_clients, 1, __ATOMIC_RELAXED);
+        close(sock);
+        free(connect_msg);
+        free_client(cli);
+        return -1;
+    }
     
-    DEBUG_PRINTF(DEBUG_CLIENTS, "New client from %s, fd=%i\n",
-            cli->hostname,
-            cli->sock);
+    DEBUG_PRINTF(DEBUG_CLIENTS, "New client from %s, fd=%i, loop=%d\n",
+            cli->cold->hostname,
+            cli->sock,
+            loop->id);
     
-    cli->node_clients = add_item(clients, cli); // Backward pointer to server's client list
+    if (served_by_core(server_info, cli))
+        register_client(server_info, cli);
+    else
+        mailbox_post(&server_info->loop->mailbox, connect_msg);
     return 0;
 }
 
 
 
-
-/* Handle new input data from the client.
+/* Stop all I/O on the socket of a client that has quit, and close it.
+ * The client's state is freed later on by |reap_zombies()|.
  */
-int handle_data(server_info_t* server_info, client_t* cli)
+void release_client(server_info_t* server_info, client_t* cli)
 {
-    // Precondition:
-    // Client's input buffer must contain less than RFC_MAX_MSG_LEN bytes
-    assert(cli->inbuf_size < RFC_MAX_MSG_LEN);
-    
-    // Compute buffer offset (and continue reading)
-    char *buf_contd = cli->inbuf + cli->inbuf_size;
-    long bytes_read = read(cli->sock,
-                           buf_contd,
-                           MAX_MSG_LEN - cli->inbuf_size);
-    
-    if (bytes_read < 0)
+    io_loop_t* loop = server_info->loop;
+    // Last chance for the pending replies, as far as the socket takes them
+    if (!cli->out_busy)
+        outq_write(&cli->outq, cli->sock);
+    outq_clear(&cli->outq);
+    // The core loop may be waiting to write to any client
+    loop->engine->unwatch(loop, cli);
+    if (served_by_core(server_info, cli))
+        close(cli->sock);
+    else
     {
-        // Nothing to read due to non-blocking fd
-        if (errno == EAGAIN)
-            return 0;
-        // Something else went wrong (connection reset by client, etc.)
-        else
-        {
-            DEBUG_PERROR("read() failed");
-            return -1;
-        }
+        mailbox_post(&cli->loop->mailbox, cli->cold->release_msg);
+        cli->cold->release_msg = NULL;
     }
-    // Connection closed by client (EOF)
-    else if (bytes_read == 0)
+}
+
+
+
+/* Queue a reference to |buf| (whole lines) for the client (core loop only).
+ * The output is sent at the end of the current tick by |flush_output()|,
+ * together with everything else queued for the client meanwhile.
+ * Returns -1 if the client is not keeping up with its output (more than
+ * |sendq_max| bytes queued).
+ */
+int send_outbuf(server_info_t* server_info, client_t* cli, OutBuf* buf)
+{
+    if (cli->outq.bytes + buf->len > server_info->sendq_max)
     {
-        DEBUG_PRINTF(DEBUG_INPUT, "EOF\n");
+        DEBUG_PRINTF(DEBUG_REPLIES, "Max SendQ exceeded (fd=%d, %lu bytes queued)\n",
+                     cli->sock, cli->outq.bytes);
         return -1;
     }
-    
-    // Else, we've read some data
-    DEBUG_PRINTF(DEBUG_SPLIT, "handle_data() got %lu bytes\n", bytes_read);
-    
-    if (cli->keep_throwing)
+    if (outq_push(&cli->outq, buf) < 0)
+        return -1;
+    // Unless the engine is already waiting for the socket to be writable
+    if (!cli->out_busy && !cli->dirty)
     {
-        DEBUG_PRINTF(DEBUG_SPLIT, "Keep throwing ...\n");
+        cli->dirty = TRUE;
+        cli->next_dirty = server_info->dirty;
+        server_info->dirty = cli;
     }
-    else if (cli->inbuf_size > 0)
+    return 0;
+}
+
+
+
+/* Start sending the output queued during this tick (core loop only).
+ * Each client's output goes out with as few syscalls as its socket
+ * allows (one writev() with the epoll engine).
+ */
+void flush_output(server_info_t* server_info)
+{
+    io_loop_t* loop = server_info->loop;
+    client_t* cli;
+    // Clients that fail here quit, which may queue output for others
+    while ((cli = server_info->dirty) != NULL)
     {
-        DEBUG_PRINTF(DEBUG_SPLIT, "Assembling an incomplete msg ...\n");
+        server_info->dirty = cli->next_dirty;
+        cli->dirty = FALSE;
+        cli->next_dirty = NULL;
+        if (cli->zombie)
+            continue;
+        if (loop->engine->flush(loop, cli) < 0)
+            output_failed(server_info, cli);
     }
+}
+
+
+
+/* Handle a client whose connection failed while its queued output was
+ * being sent (core loop only).
+ */
+void output_failed(server_info_t* server_info, client_t* cli)
+{
+    fake_quit(server_info, cli);
+}
+
+
+
+/* Fake a QUIT command on behalf of a client (core loop only).
+ */
+static void fake_quit(server_info_t* server_info, client_t* cli)
+{
+    if (cli->zombie)
+        return;
+    cli->registered = 1; // Ugly but quick fix
+    handle_line("QUIT", 4, server_info, cli);
+}
+
+
+
+/* Handle a client whose connection is gone, as detected by the loop
+ * serving its socket.
+ */
+void client_hangup(server_info_t* server_info, client_t* cli)
+{
+    if (served_by_core(server_info, cli))
+        fake_quit(server_info, cli);
+    else if (cli->cold->hangup_msg) // Only the first time
+    {
+        mailbox_post(&server_info->loop->mailbox, cli->cold->hangup_msg);
+        cli->cold->hangup_msg = NULL;
+    }
+}
+
+
+
+
+/* Handle a complete message from a client, or pass it on to the core loop.
+ * |line| is |len| bytes long and NUL-terminated.
+ */
+static void dispatch_line(server_info_t* server_info, client_t* cli, char* line, size_t len)
+{
+    if (served_by_core(server_info, cli))
+        handle_line(line, len, server_info, cli);
     else
     {
-        DEBUG_PRINTF(DEBUG_SPLIT, "Start of something new ...\n");
+        Message* msg = new_message(MSG_LINE, cli, line, len);
+        if (!msg)
+        {
+            DEBUG_PRINTF(DEBUG_ERRS, "Out of memory: line from fd=%d dropped\n", cli->sock);
+            return;
+        }
+        mailbox_post(&server_info->loop->mailbox, msg);
     }
+}
+
+
+
+/* Whether the client has quit while its input was being handled.
+ * Only the core loop runs commands, so this can only happen there.
+ */
+static int input_stopped(server_info_t* server_info, client_t* cli)
+{
+    return served_by_core(server_info, cli) && cli->zombie;
+}
+
+
+
+/* Hold on to the incomplete message at the end of the client's input,
+ * of |len| bytes at |data| (possibly none), until the rest arrives.
+ * Only then does the client borrow a buffer from the pool, and it gives
+ * it back as soon as the message is complete.
+ */
+static void keep_partial(server_info_t* server_info, client_t* cli,
+                         const char* data, size_t len)
+{
+    client_cold_t* cold = cli->cold;
+    if (len > 0 && !cold->partial)
+    {
+        cold->partial = pool_alloc(&cli->loop->partial_pool);
+        if (!cold->partial)
+        {
+            // Out of memory: the message cannot be assembled
+            cold->keep_throwing = TRUE;
+            len = 0;
+        }
+    }
+    else if (len == 0 && cold->partial)
+    {
+        pool_free(&cli->loop->partial_pool, cold->partial);
+        cold->partial = NULL;
+    }
+    if (len > 0)
+        memcpy(cold->partial, data, len);
+    cold->partial_len = len;
+}
+
+
+/* Split the input in the loop's read buffer into messages, and handle
+ * every complete message. The buffer starts with the client's incomplete
+ * message from last time (if any), followed by |bytes_read| new bytes.
+ * What remains is the initial segment of an incomplete message, which
+ * the client keeps until the next read (see |keep_partial()|).
+ *
+ * The buffer is scanned once: the bytes left over from last time are
+ * known to contain no delimiter. Messages are handled in place (their
+ * delimiter is replaced with a NUL), and those longer than
+ * |RFC_MAX_MSG_LEN| are thrown away, even if they arrive in pieces.
+ */
+static void split_input(server_info_t* server_info, client_t* cli, size_t bytes_read)
+{
+    client_cold_t* cold = cli->cold;
+    DEBUG_PRINTF(DEBUG_SPLIT, "handle_data() got %lu bytes%s\n", bytes_read,
+                 cold->keep_throwing ? ", keep throwing ..." :
+                 cold->partial_len > 0 ? ", assembling an incomplete msg ..." : "");
     
-    DEBUG_PRINTF(DEBUG_SPLIT, "---- Start splitting ---- \n");
-    
-    char *msg = cli->inbuf; // Start of the msg
-    char *cr, *lf, *end;
-    while (msg < cli->inbuf + MAX_MSG_LEN)
+    char* buf = cli->loop->readbuf;
+    size_t start = 0;                   // Start of the current message
+    size_t pos = cold->partial_len;     // Where to look for its end
+    size_t end = cold->partial_len + bytes_read;
+    while (pos < end && !input_stopped(server_info, cli))
     {
-        // Look for the next '\r' or '\n'
-        cr = strchr(msg, '\r');
-        lf = strchr(msg, '\n');
-        if (!cr && !lf) // All complete messages have been handled
+        size_t eol = pos + scan_eol(buf + pos, end - pos);
+        if (eol == end) // All complete messages have been handled
             break;
-        if (!cr)
-            end = lf;
-        else if (!lf)
-            end = cr;
-        else
-            end = MIN(cr, lf);
-        *end = '\0';
-        
-//        DEBUG_PRINTF(DEBUG_SPLIT, "Msg: %s\n", msg);
+        size_t len = eol - start;
         
         // The remaining portion of an incomplete long message has arrived
         // => Ignore this long message
-        if ( cli->keep_throwing )
+        if (cold->keep_throwing)
         {
             DEBUG_PRINTF(DEBUG_SPLIT, "Stop throwing. Please don't do this again\n");
-            cli->keep_throwing = FALSE;
+            cold->keep_throwing = FALSE;
         }
-        else if (strlen(msg) <= RFC_MAX_MSG_LEN)
+        // Else, this new message is too long and we ignore it
+        else if (len > RFC_MAX_MSG_LEN)
         {
-            DEBUG_PRINTF(DEBUG_SPLIT, "Message looks good (%lu bytes): %s\n", strlen(msg), msg);
-            handle_line(msg, server_info, cli);
+            DEBUG_PRINTF(DEBUG_SPLIT, "New message too long (%lu bytes). Thrown away\n", len);
         }
-        // Else, this new message is too long and we ignore it
-        else
+        // Empty messages (such as between "\r" and "\n") are skipped
+        else if (len > 0)
         {
-            DEBUG_PRINTF(DEBUG_SPLIT, "New message too long (%lu bytes). Thrown away\n", strlen(msg));
+            buf[eol] = '\0';
+            DEBUG_PRINTF(DEBUG_SPLIT, "Message looks good (%lu bytes): %s\n", len, buf + start);
+            dispatch_line(server_info, cli, buf + start, len);
         }
-        
-        msg = end + 1;
+        start = pos = eol + 1;
     }
-    DEBUG_PRINTF(DEBUG_SPLIT, "---- Finished splitting ---- \n");
     
-    size_t remaining_msg_len = strlen(msg);
-    // Nothing else to read
-    if ( remaining_msg_len == 0)
-    {
-        DEBUG_PRINTF(DEBUG_SPLIT, "No incomplete msg\n");
-        memset(&(cli->inbuf), '\0', sizeof(cli->inbuf));
-        cli->inbuf_size = 0;
-        
-    }
+    size_t remaining_msg_len = end - start;
     // Throw away an incomplete message if it is already too long
     // and keep throwing when the remaining portion arrives later
-    else if (cli->keep_throwing || remaining_msg_len >= RFC_MAX_MSG_LEN)
+    if (cold->keep_throwing || remaining_msg_len >= RFC_MAX_MSG_LEN)
     {
-        DEBUG_PRINTF(DEBUG_SPLIT, "We'll keep throwing next time we see you ...\n");
-        memset(&(cli->inbuf), '\0', sizeof(cli->inbuf));
-        cli->inbuf_size = 0;
-        cli->keep_throwing = TRUE;
+        if (remaining_msg_len > 0)
+        {
+            DEBUG_PRINTF(DEBUG_SPLIT, "We'll keep throwing next time we see you ...\n");
+            cold->keep_throwing = TRUE;
+        }
+        keep_partial(server_info, cli, NULL, 0);
     }
     // What remains in the buffer is the initial segment of an incomplete msg,
     // assuming the rest will be delivered next time.
-    // Move this segment to the beginning of the buffer
     else
     {
-        // Temporary buffer
-        // Techically we only need RFC_MAX_MSG_LEN bytes, since remaining_msg_len < RFC_MAX_MSG_LEN
-        char tmp[RFC_MAX_MSG_LEN+1];
-        tmp[RFC_MAX_MSG_LEN] = '\0';
-        // Copy msg -> tmp
-        strcpy(tmp, msg);
-        // Clear input buffer
-        memset(&(cli->inbuf), '\0', sizeof(cli->inbuf));
-        // Copy tmp -> msg
-        strcpy(cli->inbuf, tmp);
-        cli->inbuf_size = remaining_msg_len;
-        
-        DEBUG_PRINTF(DEBUG_SPLIT,
-                     "Incomplete msg (%lu bytes):\n%s\nWe'll handle this later\n",
-                     strlen(cli->inbuf), cli->inbuf);
-//        print_hex(DEBUG_INPUT, cli->inbuf, MAX_MSG_LEN);
-//        DEBUG_PRINTF(DEBUG_INPUT, "\n");
+        keep_partial(server_info, cli, buf + start, remaining_msg_len);
+        if (remaining_msg_len > 0)
+            DEBUG_PRINTF(DEBUG_SPLIT, "Incomplete msg (%lu bytes). We'll handle this later\n",
+                         remaining_msg_len);
+    }
+}
+
+
+
+/* Copy the client's incomplete message (if any) to the start of the loop's
+ * read buffer, and return its length: new input goes right after it.
+ */
+static size_t restore_partial(client_t* cli)
+{
+    client_cold_t* cold = cli->cold;
+    // Precondition:
+    // Client's incomplete message must be less than RFC_MAX_MSG_LEN bytes
+    assert(cold->partial_len < RFC_MAX_MSG_LEN);
+    if (cold->partial_len > 0)
+        memcpy(cli->loop->readbuf, cold->partial, cold->partial_len);
+    return cold->partial_len;
+}
+
+
+
+/* Read once from the client's socket and handle every complete message.
+ * Returns 1 if some data has been read, 0 if the socket would block,
+ * and -1 on EOF or error.
+ */
+static int read_data(server_info_t* server_info, client_t* cli)
+{
+    // Continue reading after the incomplete message
+    size_t offset = restore_partial(cli);
+    long bytes_read = read(cli->sock,
+                           cli->loop->readbuf + offset,
+                           READBUF_SIZE - offset);
+    
+    if (bytes_read < 0)
+    {
+        // Nothing to read due to non-blocking fd
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        // Something else went wrong (connection reset by client, etc.)
+        else
+        {
+            DEBUG_PERROR("read() failed");
+            return -1;
+        }
+    }
+    // Connection closed by client (EOF)
+    else if (bytes_read == 0)
+    {
+        DEBUG_PRINTF(DEBUG_INPUT, "EOF\n");
+        return -1;
+    }
+    
+    // Else, we've read some data
+    split_input(server_info, cli, bytes_read);
+    return 1;
+}
+
+
+
+/* Handle |len| bytes of input data from the client, received by the I/O
+ * engine into its own buffer.
+ */
+void handle_input(server_info_t* server_info, client_t* cli, const char* data, size_t len)
+{
+    while (len > 0 && !input_stopped(server_info, cli))
+    {
+        size_t offset = restore_partial(cli);
+        size_t chunk = MIN(len, READBUF_SIZE - offset);
+        memcpy(cli->loop->readbuf + offset, data, chunk);
+        split_input(server_info, cli, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+
+
+/* Handle new input data from the client.
+ * Client sockets are edge-triggered, so keep reading until the socket
+ * would block, or the client quits in the middle of its input.
+ */
+int handle_data(server_info_t* server_info, client_t* cli)
+{
+    int rc;
+    do {
+        rc = read_data(server_info, cli);
+    } while (rc > 0 && !input_stopped(server_info, cli));
+    return rc;
+}
+
+
+
+/* Free the state of the clients that have quit, and of the channels
+ * removed.
+ * Called once per event loop iteration, after all ready sockets have been
+ * handled, so that no pending event (nor list iterator) may refer to a
+ * freed client or channel.
+ */
+void reap_zombies(server_info_t* server_info)
+{
+    Node* node = server_info->zombies->head;
+    while (node)
+    {
+        client_t* zombie = LIST_ITEM(node, client_t, node_zombies);
+        node = node->next; // Before |zombie| is freed
+        // A worker loop may still post messages about its client
+        // until it has closed the client's socket
+        if (!served_by_core(server_info, zombie) && !zombie->released)
+            continue;
+        drop_node(server_info->zombies, &zombie->node_zombies);
+        __atomic_sub_fetch(&server_info->num_clients, 1, __ATOMIC_RELAXED);
+        release_handle(&server_info->client_table, zombie);
+        free(zombie->chans);
+        free_stream(zombie);
+        if (served_by_core(server_info, zombie))
+            free_client(zombie);
+        else
+        {
+            // Only the worker loop may touch its pools
+            Message* msg = zombie->cold->release_msg;
+            zombie->cold->release_msg = NULL;
+            msg->type = MSG_FREE;
+            mailbox_post(&zombie->loop->mailbox, msg);
+        }
+    }
+
+    while (server_info->retired)
+    {
+        channel_t* ch = server_info->retired;
+        server_info->retired = ch->next_retired;
+        free(ch->members);
+        free(ch->names.data);
+        pool_free(&server_info->channel_pool, ch);
     }
-    DEBUG_PRINTF(DEBUG_SPLIT, "\n");
-    return 0;
 }
 
 
@@ -4,10 +4,20 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include "linked-list.h"
+#include "outq.h"
+#include "hash-table.h"
+#include "pool.h"
+#include "client-table.h"
+#include "mailbox.h"
 
-#define MAX_CLIENTS 512
-#define MAX_MSG_TOKENS 10
+#define MAX_CLIENTS 65536
+#define MAX_EVENTS 256
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_SENDQ (128 * 1024)
+#define DEFAULT_PREALLOC 256
+#define POOL_SLAB_OBJS 64
 #define MAX_MSG_LEN 1024
+#define READBUF_SIZE 16384
 #define MAX_USERNAME 32
 #define MAX_HOSTNAME 64
 #define MAX_SERVERNAME 64
@@ -16,51 +26,167 @@
 
 #define RFC_MAX_MSG_LEN 512
 #define RFC_MAX_NICKNAME 9
+#define MAX_SOURCE (RFC_MAX_NICKNAME + MAX_USERNAME + MAX_HOSTNAME + 3)
 
 typedef struct __client_struct client_t;
 typedef struct __channel_struct channel_t;
+typedef struct io_loop io_loop_t;
+typedef struct __stream_struct stream_t;
 
 typedef struct {
     char hostname[MAX_HOSTNAME];
+    char prefix[MAX_HOSTNAME+2]; // ":hostname ", which starts server replies
+    size_t prefix_len;
     LinkedList* clients;
     LinkedList* channels;
     LinkedList* zombies;
+    LinkedList* streams;   // LIST and WHO replies in progress (see |continue_streams()|)
+    HashTable nicks;       // Folded nickname -> client
+    HashTable chan_names;  // Folded channel name -> channel
+    io_loop_t* loop;       // Core event loop, which runs the command handlers
+    int num_loops;         // Event loops, stored contiguously from |loop|
+    unsigned int next_serial;
+    int num_clients;       // Accepted and not yet freed, in all loops
+    struct resolver* resolver;
+    size_t sendq_max;      // Output queued for a client before it is dropped
+    int cork;              // Flush output under TCP_CORK
+    client_t* dirty;       // Clients with output queued during this tick
+    channel_t* retired;    // Channels removed during this tick
+    unsigned int stamp;    // Of the last fan-out (see |fanout()|)
+    client_t** peers;      // Stack of the peers of fan-outs in progress
+    size_t peers_len;
+    size_t peers_max;
+    channel_t** snapshot;  // Channels sorted by key, for LIST (see |channel_snapshot()|)
+    int snapshot_len;
+    int snapshot_max;
+    int snapshot_valid;    // Until a channel is created or removed
+    unsigned int snapshot_gen; // Bumped by every rebuild of |snapshot|
+    ClientTable client_table; // Handles on the clients (see client-table.h)
+    Pool channel_pool;     // channel_t (core loop only)
 } server_info_t;
 
+/* Nicknames packed into the lines of a NAMES reply (see |send_names()|):
+ * separated by spaces, with each line ending in '\n' */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t max;
+    size_t line_len;         // Of the last line
+    int lines;
+} names_t;
+
+/* Entry of a channel's |members| */
+typedef struct {
+    client_t* client;        // NULL for a hole (see |end_members()|)
+    int chan_slot;           // Of the channel in the client's |chans|
+} member_t;
+
+/* Entry of a client's |chans| */
+typedef struct {
+    channel_t* channel;
+    int member_index;        // Of the client in the channel's |members|
+} membership_t;
+
 struct __channel_struct {
     char name[MAX_CHANNAME];
-    Node* node_channels;
-    LinkedList* members;
+    char key[MAX_CHANNAME];  // Folded |name| (see |casefold()|)
+    Node node_channels;
+    member_t* members;       // Dense array, with holes only during loops
+    int members_len;         // Slots used in |members|
+    int members_max;
+    int num_members;
+    int iterating;           // Loops over |members| in progress
+    names_t names;           // Cached nicknames of the members
+    int names_valid;
+    channel_t* next_retired;
 };
 
-struct __client_struct {
-    int sock;
+/* Client state that the fan-out loops never look at (see |client_t|) */
+typedef struct {
     struct sockaddr_in cliaddr;
-    size_t inbuf_size;
+    size_t partial_len;
     int keep_throwing;
-    int registered;
-    int zombie;
-    channel_t* channel;
-    Node* node_clients;
-    Node* node_members;
     char hostname[MAX_HOSTNAME];
     char servername[MAX_SERVERNAME]; // Not used, so can be removed
     char user[MAX_USERNAME];
-    char nick[MAX_USERNAME];
     char realname[MAX_REALNAME];
-    char inbuf[MAX_MSG_LEN+1];
+    char source[MAX_SOURCE]; // ":nick!user@hostname" (see |update_source()|)
+    size_t source_len;
+    char* partial;       // Start of an incomplete message, if any (see |split_input()|)
+    stream_t* stream;    // Last LIST or WHO reply, kept until replaced
+    Message* hangup_msg; // Reserved for |client_hangup()| (worker loops only)...
+    Message* release_msg; // ... and |release_client()|, so they cannot fail
+} client_cold_t;
+
+/* Client. Only the hot fields, which a broadcast touches for every member,
+ * are kept here, the first of them in the first cache line; the rest lives
+ * in the |cold| record. */
+struct __client_struct {
+    unsigned int visit;  // Stamp of the last fan-out that reached it
+    int sock;
+    int zombie;
+    OutQueue outq;       // Output not sent yet (core loop only)
+    int dirty;           // In the server's |dirty| list
+    int out_busy;        // The engine is waiting to send more output
+    client_t* next_dirty;
+    membership_t* chans; // Channels joined, in no particular order
+    int num_chans;
+    int max_chans;
+    char nick[MAX_USERNAME];
+    unsigned int serial; // Tells apart successive clients on the same socket
+    int registered;
+    int released;        // Socket closed by the worker loop serving it
+    client_handle_t handle; // Null until registered by the core loop
+    io_loop_t* loop;     // Event loop serving the client's socket
+    Node node_clients;
+    Node node_zombies;
+    char nick_key[RFC_MAX_NICKNAME+1]; // Folded |nick| (see |casefold()|)
+    client_cold_t* cold;
+};
+
+
+
+/* Messages exchanged between event loops (see |handle_messages()|) */
+enum {
+    MSG_CONNECT,
+    MSG_LINE,
+    MSG_HANGUP,
+    MSG_RELEASE,
+    MSG_RELEASED,
+    MSG_FREE,
+    MSG_RESOLVED,
 };
 
+int open_listener(uint16_t port, int reuseport, int backlog, int defer_secs);
 
+void* run_worker_loop(void* arg);
 
-int build_fd_set(fd_set* fds, int listenfd, LinkedList* clients);
+void handle_messages(io_loop_t* loop);
 
 int set_non_blocking(int fd);
 
-int handle_new_connection(int listenfd, LinkedList* clients);
+void release_client(server_info_t* server_info, client_t* cli);
+
+int send_outbuf(server_info_t* server_info, client_t* cli, OutBuf* buf);
+
+void output_failed(server_info_t* server_info, client_t* cli);
+
+void flush_output(server_info_t* server_info);
+
+int handle_new_connection(io_loop_t* loop);
+
+void report_accept_stats(server_info_t* server_info);
+
+int accept_client(io_loop_t* loop, int sock, struct sockaddr_in* cli_addr);
 
 int handle_data(server_info_t* server_info, client_t* cli);
 
+void handle_input(server_info_t* server_info, client_t* cli, const char* data, size_t len);
+
+void client_hangup(server_info_t* server_info, client_t* cli);
+
+void reap_zombies(server_info_t* server_info);
+
 void exit_on_error(long __rc, const char* str);
 
 #endif /* _SIRCS_H_ */